@@ -0,0 +1,133 @@
+// Results and flags of the 8-bit ALU, generated at compile time.
+// Flags are packed the same way as F: Z N H C in bit 7 to 4.
+// ADD/ADC/SUB/SBC have no table: 2x256x256 entries per operation cost more
+// in cache than the few compares they save (see util/test/bench-alu.cpp).
+
+#ifndef ALU_TABLE_H_INCLUDED
+#define ALU_TABLE_H_INCLUDED
+
+#include <cstdint>
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // Operations in rotate_table
+  enum {rot_rlc, rot_rrc, rot_rl, rot_rr, rot_sla, rot_sra, rot_srl, rot_swap};
+
+  struct alu_table_t
+  {
+    // [val], flags of val + 1 and val - 1, without C
+    byte_t inc_flags[256];
+    byte_t dec_flags[256];
+    // [N H C][val], result << 8 | flags
+    dbyte_t daa[8][256];
+    // [operation][carry][val], result << 8 | flags
+    dbyte_t rotate[8][2][256];
+  };
+
+  constexpr byte_t pack_flags(bool zero, bool sub, bool h_carry, bool carry)
+  {
+    return zero << 7 | sub << 6 | h_carry << 5 | carry << 4;
+  }
+
+  constexpr dbyte_t alu_daa(byte_t val, bool sub, bool h_carry, bool carry)
+  {
+    // Game Boy Programming Manual pp.122
+    if (sub)
+    {
+      if (h_carry)
+        val -= 6;
+      if (carry)
+        val -= 0x60;
+    }
+    else
+    {
+      if ((val & 0xf) > 9 || h_carry)
+        val += 6;
+      if ((val & 0xf0) > 0x90 || carry)
+      {
+        val += 0x60;
+        carry = true;
+      }
+      else
+      {
+        carry = false;
+      }
+    }
+    return val << 8 | pack_flags(val == 0, sub, false, carry);
+  }
+
+  constexpr dbyte_t alu_rotate(int op, bool carry, byte_t val)
+  {
+    bool new_c = false;
+    switch (op)
+    {
+      case rot_rlc:
+      val = (val << 1) | (val >> 7);
+      new_c = val & 1;
+      break;
+
+      case rot_rrc:
+      val = (val >> 1) | (val << 7);
+      new_c = val & 0x80;
+      break;
+
+      case rot_rl:
+      new_c = val & 0x80;
+      val = (val << 1) | carry;
+      break;
+
+      case rot_rr:
+      new_c = val & 1;
+      val = (val >> 1) | (carry << 7);
+      break;
+
+      case rot_sla:
+      new_c = val & 0x80;
+      val <<= 1;
+      break;
+
+      case rot_sra:
+      new_c = val & 1;
+      val = (val >> 1) | (val & 0x80);
+      break;
+
+      case rot_srl:
+      new_c = val & 1;
+      val >>= 1;
+      break;
+
+      default:
+      val = (val << 4) | (val >> 4);
+      break;
+    }
+    return val << 8 | pack_flags(val == 0, false, false, new_c);
+  }
+
+  constexpr alu_table_t make_alu_table()
+  {
+    alu_table_t t{};
+    for (int val = 0; val < 256; val++)
+    {
+      t.inc_flags[val] = pack_flags(val == 0xff, false, (val & 0xf) == 0xf,
+        false);
+      t.dec_flags[val] = pack_flags(val == 1, true, (val & 0xf) == 0, false);
+      for (int nhc = 0; nhc < 8; nhc++)
+      {
+        t.daa[nhc][val] = alu_daa(val, nhc & 4, nhc & 2, nhc & 1);
+      }
+      for (int op = 0; op < 8; op++)
+      {
+        for (int c = 0; c < 2; c++)
+        {
+          t.rotate[op][c][val] = alu_rotate(op, c, val);
+        }
+      }
+    }
+    return t;
+  }
+
+  constexpr alu_table_t alu_table = make_alu_table();
+};
+
+#endif
@@ -0,0 +1,322 @@
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <map>
+#include <vector>
+#include "block-cache.h"
+#include "cpu.h"
+#include "jit-x86-64.h"
+#include "../memory/memory.h"
+#include "../memory/cartridge.h"
+#include "../main/threads.h"
+
+namespace gameboy
+{
+  std::array<block_t *, 0x10000> block_table;
+  std::bitset<0x10000> code_bytes;
+
+  // Blocks of all ROM banks, keyed by where they were read from and their
+  // address. block_table holds those of the banks mapped now.
+  std::map<std::pair<const byte_t *, dbyte_t>, block_t *> rom_blocks;
+
+  // Invalidated blocks might still be running, free them later
+  std::vector<block_t *> retired_blocks;
+
+  bool block_invalidated;
+
+  // fused_ops keyed by their opcodes, -1 for the missing third one
+  std::map<std::array<int, 3>, const fused_op_t *> fused_index;
+
+  int extended_opcode(const micro_op_t &op)
+  {
+    return op.opcode == 0xcb ? 0x100 + op.op8 : op.opcode;
+  }
+
+  // Find flags overwritten before being read, and use handlers that skip
+  // them. Everything is live at the end of the block, and after any
+  // instruction the run loop might stop after (an interrupt handler might
+  // push AF).
+  void drop_dead_flags(std::vector<micro_op_t> &ops)
+  {
+    byte_t live = 0xf0;
+    for (size_t i = ops.size(); i-- > 0;)
+    {
+      micro_op_t &op = ops[i];
+      int opcode = extended_opcode(op);
+      if (instruction_may_stop[opcode])
+      {
+        live = 0xf0;
+      }
+      byte_t written = instruction_flags_written[opcode];
+      if (op.len != 0 && (written & live) == 0)
+      {
+        op.fast_handler = op_handler_nf_table[opcode];
+      }
+      live = (live & ~written) | instruction_flags_read[opcode];
+    }
+  }
+
+  // Mark the sequences with a fused handler, longest first
+  void fuse_ops(std::vector<micro_op_t> &ops)
+  {
+    if (fused_index.empty())
+    {
+      for (const fused_op_t *f = fused_ops; f->handler != nullptr; f++)
+      {
+        std::array<int, 3> key = {f->opcodes[0], f->opcodes[1],
+          f->count == 3 ? f->opcodes[2] : -1};
+        fused_index[key] = f;
+      }
+    }
+
+    size_t i = 0;
+    while (i < ops.size())
+    {
+      for (size_t count = 3; count >= 2; count--)
+      {
+        if (i + count > ops.size())
+          continue;
+        std::array<int, 3> key = {extended_opcode(ops[i]),
+          extended_opcode(ops[i + 1]),
+          count == 3 ? extended_opcode(ops[i + 2]) : -1};
+        auto it = fused_index.find(key);
+        if (it != fused_index.end())
+        {
+          ops[i].fused = it->second->handler;
+          ops[i].fused_count = count;
+          break;
+        }
+      }
+      i += ops[i].fused != nullptr ? ops[i].fused_count : 1;
+    }
+  }
+
+  const byte_t *source_of(dbyte_t addr)
+  {
+    const page_t &page = page_table[addr >> 8];
+    return page.read != nullptr ? page.read + (addr & 0xff) : &mem_at(addr);
+  }
+
+  bool block_mapped(const block_t &block)
+  {
+    return source_of(block.begin) == block.source_begin
+      && source_of(block.begin + block.size - 1) == block.source_end;
+  }
+
+  int code_watch = -1;
+
+  void code_written(dbyte_t addr, byte_t old_val, byte_t new_val)
+  {
+    if (old_val == new_val)
+      return;
+    if (code_bytes[addr])
+    {
+      invalidate_code(addr);
+    }
+    int mirror = echo_mirror(addr);
+    if (mirror >= 0 && code_bytes[mirror])
+    {
+      invalidate_code(mirror);
+    }
+  }
+
+  block_t *decode_block(dbyte_t begin)
+  {
+    block_t *block = new block_t;
+    block->begin = begin;
+    block->clocks = 0;
+    block->hits = 0;
+    block->native = nullptr;
+    block->native_generation = 0;
+    int addr = begin;
+    while (true)
+    {
+      micro_op_t op = {};
+      op.fused = nullptr;
+      op.fused_count = 1;
+      op.opcode = read_byte(addr);
+      op.len = instruction_length[op.opcode];
+      if (op.len == 2)
+      {
+        op.op8 = read_byte(addr + 1);
+      }
+      else if (op.len == 3)
+      {
+        op.op16 = read_byte(addr + 2);
+        op.op16 <<= 8;
+        op.op16 |= read_byte(addr + 1);
+      }
+
+      int opcode_extended = extended_opcode(op);
+      op.handler = op_handler_table[opcode_extended];
+      op.fast_handler = op.handler;
+      block->clocks += instruction_clocks[opcode_extended];
+      block->ops.push_back(op);
+
+      if (op.len == 0)
+      {
+        // Undefined instruction, cover it anyway
+        addr++;
+        break;
+      }
+      addr += op.len;
+      // Banks are at least 8KB, keep the block in one
+      if (instruction_is_branch[op.opcode] || addr >= 0x10000
+        || addr - begin + 3 > max_block_size
+        || addr / ram_bank_size != begin / ram_bank_size)
+      {
+        break;
+      }
+    }
+    block->size = addr - begin;
+    block->source_begin = source_of(begin);
+    block->source_end = source_of(addr - 1);
+    drop_dead_flags(block->ops);
+    fuse_ops(block->ops);
+
+    // ROM never changes. Pages of RAM holding code are watched, at both
+    // addresses of echo RAM.
+    if (code_watch < 0)
+    {
+      code_watch = add_watch(code_written);
+    }
+    for (int i = std::max(int(begin), 0x8000); i < addr && i < 0x10000; i++)
+    {
+      code_bytes[i] = true;
+      watch_page(code_watch, i >> 8);
+      int mirror = echo_mirror(i);
+      if (mirror >= 0)
+      {
+        watch_page(code_watch, mirror >> 8);
+      }
+    }
+    return block;
+  }
+
+  // Block at begin for the banks mapped now, in place of a stale one
+  block_t *find_block(dbyte_t begin)
+  {
+    if (begin >= 0x8000)
+    {
+      // Switching RAM banks drops their blocks already, see map_ram
+      if (block_table[begin] != nullptr)
+      {
+        retired_blocks.push_back(block_table[begin]);
+      }
+      return decode_block(begin);
+    }
+    block_t *&block = rom_blocks[{source_of(begin), begin}];
+    if (block == nullptr || !block_mapped(*block))
+    {
+      // The last instruction might reach into the next bank
+      if (block != nullptr)
+      {
+        retired_blocks.push_back(block);
+      }
+      block = decode_block(begin);
+    }
+    return block;
+  }
+
+  void invalidate_code(dbyte_t addr)
+  {
+    for (int begin = addr; begin > addr - max_block_size && begin >= 0;
+      begin--)
+    {
+      block_t *&block = block_table[begin];
+      if (block != nullptr && begin + block->size > addr)
+      {
+        if (begin < 0x8000)
+        {
+          rom_blocks.erase({block->source_begin, dbyte_t(begin)});
+        }
+        retired_blocks.push_back(block);
+        block = nullptr;
+        block_invalidated = true;
+      }
+    }
+    // No block covers it now
+    code_bytes[addr] = false;
+  }
+
+#ifdef BLOCK_CACHE
+  void run_instructions(long long clock_limit)
+  {
+    for (block_t *block : retired_blocks)
+    {
+      delete block;
+    }
+    retired_blocks.clear();
+
+    do
+    {
+      block_t *&entry = block_table[reg.pc()];
+      if (entry == nullptr || !block_mapped(*entry))
+      {
+        entry = find_block(reg.pc());
+      }
+      block_t &block = *entry;
+
+      // Only check the clock inside the block if it might run out
+      bool check_clock = cpu_clock + block.clocks >= clock_limit;
+      block_invalidated = false;
+
+#ifdef JIT
+      if (block.native != nullptr && block.native_generation != jit_generation)
+      {
+        // Its code was flushed
+        block.native = nullptr;
+        block.hits = 0;
+      }
+      if (block.native == nullptr && ++block.hits == jit_threshold)
+      {
+        block.native = compile_block(block);
+        block.native_generation = jit_generation;
+      }
+      if (block.native != nullptr && !check_clock)
+      {
+        // Stops by itself if an interrupt is pending, etc.
+        jit_clocks += block.native();
+        continue;
+      }
+#endif
+
+      for (size_t i = 0; i < block.ops.size(); i++)
+      {
+        const micro_op_t &op = block.ops[i];
+        if (op.fused != nullptr && !check_clock)
+        {
+          // Nothing but the last one can stop the block
+          op.fused(&op);
+          i += op.fused_count - 1;
+        }
+        else
+        {
+          reg.pc() += op.len;
+          // Might stop anywhere if the clock runs out, keep all the flags
+          int clocks = check_clock ? op.handler(op.op8, op.op16)
+            : op.fast_handler(op.op8, op.op16);
+          cpu_clock += clocks;
+          if (clocks < 0)
+          {
+            // Undefined instruction
+            return;
+          }
+        }
+        if ((check_clock && cpu_clock >= clock_limit) || interrupt_address
+          || cpu_mode != cpu_mode_normal)
+        {
+          return;
+        }
+        if (block_invalidated)
+        {
+          // Code after pc might have changed, decode it again
+          break;
+        }
+      }
+    } while (cpu_clock < clock_limit && !interrupt_address
+      && cpu_mode == cpu_mode_normal);
+  }
+#endif
+};
@@ -0,0 +1,90 @@
+// Predecoded basic blocks, so straight-line code is decoded only once.
+// Used by run_instructions if BLOCK_CACHE is defined.
+
+#ifndef BLOCK_CACHE_H_INCLUDED
+#define BLOCK_CACHE_H_INCLUDED
+
+#include <array>
+#include <bitset>
+#include <vector>
+#include "../util/byte-type.h"
+#include "cpu.h"
+
+namespace gameboy
+{
+  struct micro_op_t;
+
+  // Run several instructions from ops on, advancing pc and cpu_clock after
+  // each, return the total clocks
+  typedef int (*fused_handler_t)(const micro_op_t *ops);
+
+  // A decoded instruction, with operands already extracted
+  struct micro_op_t
+  {
+    op_handler_t handler;
+    // Same as handler, but leaves flags alone if nobody reads them before
+    // they are overwritten. Only valid if the block runs to its end.
+    op_handler_t fast_handler;
+    // Fused handler of this and the following instructions, if any
+    fused_handler_t fused;
+    dbyte_t op16;
+    byte_t op8;
+    byte_t opcode;
+    byte_t len;
+    // Instructions run by fused
+    byte_t fused_count;
+  };
+
+  // A sequence of instructions run by one handler, see gen-instruction-set.py.
+  // Opcodes of prefix cb at 0x100-0x1ff.
+  struct fused_op_t
+  {
+    int count;
+    int opcodes[3];
+    fused_handler_t handler;
+  };
+
+  // Terminated by a null handler
+  extern const fused_op_t fused_ops[];
+
+  // Native code of a block, returns number of clocks executed
+  typedef long long (*native_block_t)();
+
+  // Instructions from begin up to (and including) the next branch
+  struct block_t
+  {
+    dbyte_t begin;
+    // Number of bytes covered
+    int size;
+    // Where the first and the last byte were read from. The block is stale
+    // if a bank switch maps other memory there.
+    const byte_t *source_begin, *source_end;
+    // Clocks of the whole block, branches counted as taken
+    int clocks;
+    std::vector<micro_op_t> ops;
+    // Times executed, and the compiled code (if any). The code is gone if
+    // jit_generation changed since it was compiled.
+    int hits;
+    native_block_t native;
+    unsigned native_generation;
+  };
+
+  // Longest block in bytes
+  const int max_block_size = 64;
+
+  // Blocks keyed by the address of their first instruction, for the banks
+  // mapped last time the address was run
+  extern std::array<block_t *, 0x10000> block_table;
+
+  // Bytes of RAM covered by any block
+  extern std::bitset<0x10000> code_bytes;
+
+  // Set when some block is invalidated, the running one included
+  extern bool block_invalidated;
+
+  // Drop blocks covering addr. Pages with code are watched, and writes
+  // changing a byte in code_bytes call this.
+  void invalidate_code(dbyte_t addr);
+};
+
+#endif
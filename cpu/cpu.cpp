@@ -3,8 +3,11 @@
 #include <string>
 #include <cstdio>
 #include "cpu.h"
+#include "alu-table.h"
+#include "opcode-profile.h"
 #include "../memory/memory.h"
 #include "../main/threads.h"
+#include "../main/idle-loop.h"
 
 namespace gameboy
 {
@@ -13,26 +16,53 @@ namespace gameboy
 
   void fetch_instruction(byte_t *opcode, byte_t *op8, dbyte_t *op16)
   {
-    *opcode = memory.at(reg.pc());
+    *opcode = read_byte(reg.pc());
     int len = instruction_length[*opcode];
     if (len == 2)
     {
-      *op8 = memory.at(reg.pc() + 1);
+      *op8 = read_byte(reg.pc() + 1);
     }
     else if (len == 3)
     {
-      *op16 = memory.at(reg.pc() + 2);
+      *op16 = read_byte(reg.pc() + 2);
       *op16 <<= 8;
-      *op16 |= memory.at(reg.pc() + 1);
+      *op16 |= read_byte(reg.pc() + 1);
     }
     reg.pc() += len;
   }
 
+#if !defined(THREADED_DISPATCH) && !defined(BLOCK_CACHE) \
+  && !defined(STATIC_ROM)
+  void run_instructions(long long clock_limit)
+  {
+    byte_t opcode, op8;
+    dbyte_t op16;
+    do
+    {
+#ifdef PROFILE_OPCODES
+      dbyte_t addr = reg.pc();
+#endif
+      fetch_instruction(&opcode, &op8, &op16);
+#ifdef PROFILE_OPCODES
+      record_opcode(opcode == 0xcb ? 0x100 + op8 : opcode, addr);
+#endif
+      int clocks = exec_instruction(opcode, op8, op16);
+      cpu_clock += clocks;
+      if (clocks < 0)
+      {
+        // Undefined instruction
+        return;
+      }
+    } while (cpu_clock < clock_limit && !interrupt_address
+      && cpu_mode == cpu_mode_normal);
+  }
+#endif
+
   std::string get_disas()
   {
     using std::string;
     using std::to_string;
-    byte_t opcode = memory.at(reg.pc());
+    byte_t opcode = read_byte(reg.pc());
     int len = instruction_length[opcode];
     if (len == 1)
     {
@@ -40,7 +70,7 @@ namespace gameboy
     }
     else if (len == 2)
     {
-      byte_t op8 = memory.at(reg.pc() + 1);
+      byte_t op8 = read_byte(reg.pc() + 1);
       if (opcode == 0xcb)
       {
         return string(disas_table[0x100 + op8]);
@@ -66,13 +96,115 @@ namespace gameboy
     const byte_t zero_flag = 1 << 7, sub_flag = 1 << 6;
     const byte_t h_carry_flag = 1 << 5, carry_flag = 1 << 4;
 
-    bool Z() { return reg.f() & zero_flag; }
-    bool C() { return reg.f() & carry_flag; }
+    lazy_flags_t lazy_flags;
+
+    void set_lazy_flags(flag_op_t op, int result, byte_t v1, byte_t v2,
+      bool h_carry, bool carry)
+    {
+      lazy_flags.op = op;
+      lazy_flags.result = result;
+      lazy_flags.v1 = v1;
+      lazy_flags.v2 = v2;
+      lazy_flags.h_carry = h_carry;
+      lazy_flags.carry = carry;
+    }
+
+    bool Z()
+    {
+      const lazy_flags_t &l = lazy_flags;
+      switch (l.op)
+      {
+        case flag_op_add:
+        case flag_op_sub:
+        return l.result == 0;
+
+        case flag_op_inc:
+        return l.v1 == 0xff;
+
+        case flag_op_dec:
+        return l.v1 == 1;
+
+        case flag_op_logic:
+        return byte_t(l.result) == 0;
+
+        default:
+        return reg.f() & zero_flag;
+      }
+    }
+
+    bool C()
+    {
+      const lazy_flags_t &l = lazy_flags;
+      switch (l.op)
+      {
+        case flag_op_add:
+        return l.result >= 0x100;
+
+        case flag_op_sub:
+        return l.result < 0;
+
+        case flag_op_inc:
+        case flag_op_dec:
+        case flag_op_logic:
+        return l.carry;
+
+        default:
+        return reg.f() & carry_flag;
+      }
+    }
+
     bool NZ() { return !Z(); }
     bool NC() { return !C(); }
 
+    void set_packed_flags(byte_t flags)
+    {
+      lazy_flags.op = flag_op_none;
+      reg.f() = flags;
+    }
+
+    void flush_flags()
+    {
+      const lazy_flags_t &l = lazy_flags;
+      switch (l.op)
+      {
+        case flag_op_none:
+        return;
+
+        // Z only if the unwrapped result is 0, as Z() does
+        case flag_op_add:
+        set_packed_flags(pack_flags(l.result == 0, false,
+          (l.v1 & 0xf) + (l.v2 & 0xf) + l.carry >= 0x10, l.result >= 0x100));
+        break;
+
+        case flag_op_sub:
+        set_packed_flags(pack_flags(l.result == 0, true,
+          (l.v1 & 0xf) < (l.v2 & 0xf) + l.carry, l.result < 0));
+        break;
+
+        case flag_op_inc:
+        set_packed_flags(alu_table.inc_flags[l.v1] | l.carry << 4);
+        break;
+
+        case flag_op_dec:
+        set_packed_flags(alu_table.dec_flags[l.v1] | l.carry << 4);
+        break;
+
+        default:
+        set_flag(byte_t(l.result) == 0, false, l.h_carry, l.carry);
+        break;
+      }
+    }
+
+    // Result and flags from alu_table
+    byte_t set_result_flags(dbyte_t res)
+    {
+      set_packed_flags(res);
+      return res >> 8;
+    }
+
     void set_flag(bool zero, bool sub, bool h_carry, bool carry)
     {
+      lazy_flags.op = flag_op_none;
       reg.f() = zero << 7 | sub << 6 | h_carry << 5 | carry << 4;
     }
 
@@ -124,13 +256,23 @@ namespace gameboy
 
     void JP(dbyte_t addr)
     {
+      dbyte_t from = reg.pc();
       reg.pc() = addr;
+      if (addr < from)
+      {
+        check_idle_loop(from);
+      }
     }
 
     void JR(byte_t offset)
     {
       // PC already incremented
+      dbyte_t from = reg.pc();
       reg.pc() = add_signed(reg.pc(), offset);
+      if (reg.pc() < from)
+      {
+        check_idle_loop(from);
+      }
     }
 
     void PUSH(dbyte_t val)
@@ -148,21 +290,22 @@ namespace gameboy
     byte_t ADD(byte_t v1, byte_t v2)
     {
       int res = v1 + v2;
-      set_flag(res == 0, false, (v1 & 0xf) + (v2 & 0xf) >= 0x10, res >= 0x100);
+      set_lazy_flags(flag_op_add, res, v1, v2, false, false);
       return res;
     }
 
     byte_t ADC(byte_t v1, byte_t v2)
     {
-      int res = v1 + v2 + C();
-      set_flag(res == 0, false, (v1 & 0xf) + (v2 & 0xf) + C() >= 0x10, res >= 0x100);
+      bool carry = C();
+      int res = v1 + v2 + carry;
+      set_lazy_flags(flag_op_add, res, v1, v2, false, carry);
       return res;
     }
 
     byte_t INC(byte_t val)
     {
       int res = val + 1;
-      set_flag(val == 0xff, false, (val & 0xf) == 0xf, C());
+      set_lazy_flags(flag_op_inc, res, val, 1, false, C());
       return res;
     }
 
@@ -191,27 +334,28 @@ namespace gameboy
     byte_t SUB(byte_t v1, byte_t v2)
     {
       int res = v1 - v2;
-      set_flag(res == 0, true, (v1 & 0xf) < (v2 & 0xf), res < 0);
+      set_lazy_flags(flag_op_sub, res, v1, v2, false, false);
       return res;
     }
 
     byte_t SBC(byte_t v1, byte_t v2)
     {
-      int res = v1 - (v2 + C());
-      set_flag(res == 0, true, (v1 & 0xf) < (v2 & 0xf) + C(), res < 0);
+      bool carry = C();
+      int res = v1 - (v2 + carry);
+      set_lazy_flags(flag_op_sub, res, v1, v2, false, carry);
       return res;
     }
 
     void CP(byte_t v1, byte_t v2)
     {
       int res = v1 - v2;
-      set_flag(res == 0, true, (v1 & 0xf) < (v2 & 0xf), v1 < v2);
+      set_lazy_flags(flag_op_sub, res, v1, v2, false, false);
     }
 
     byte_t DEC(byte_t val)
     {
       int res = val - 1;
-      set_flag(val == 1, true, (val & 0xf) == 0, C());
+      set_lazy_flags(flag_op_dec, res, val, 1, false, C());
       return res;
     }
 
@@ -222,19 +366,19 @@ namespace gameboy
 
     byte_t OR(byte_t v1, byte_t v2)
     {
-      set_flag((v1 | v2) == 0, false, false, false);
+      set_lazy_flags(flag_op_logic, v1 | v2, v1, v2, false, false);
       return v1 | v2;
     }
 
     byte_t AND(byte_t v1, byte_t v2)
     {
-      set_flag((v1 & v2) == 0, false, true, false);
+      set_lazy_flags(flag_op_logic, v1 & v2, v1, v2, true, false);
       return v1 & v2;
     }
 
     byte_t XOR(byte_t v1, byte_t v2)
     {
-      set_flag((v1 ^ v2) == 0, false, false, false);
+      set_lazy_flags(flag_op_logic, v1 ^ v2, v1, v2, false, false);
       return v1 ^ v2;
     }
 
@@ -242,71 +386,47 @@ namespace gameboy
     // While RR and RL rotate the combination of carry flag and val
     byte_t RLC(byte_t val)
     {
-      val = (val << 1) | (val >> 7);
-      set_flag(val == 0, false, false, val & 1);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_rlc][0][val]);
     }
 
     byte_t RRC(byte_t val)
     {
-      val = (val >> 1) | (val << 7);
-      set_flag(val == 0, false, false, val & 0x80);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_rrc][0][val]);
     }
 
     byte_t RL(byte_t val)
     {
-      bool new_c = val & 0x80;
-      val = (val << 1) | C();
-      set_flag(val == 0, false, false, new_c);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_rl][C()][val]);
     }
 
     byte_t RR(byte_t val)
     {
-      bool new_c = val & 1;
-      val = (val >> 1) | (C() << 7);
-      set_flag(val == 0, false, false, new_c);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_rr][C()][val]);
     }
 
     byte_t SLA(byte_t val)
     {
-      bool new_c = val & 0x80;
-      val <<= 1;
-      set_flag(val == 0, false, false, new_c);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_sla][0][val]);
     }
 
     byte_t SRL(byte_t val)
     {
-      bool new_c = val & 1;
-      val >>= 1;
-      set_flag(val == 0, false, false, new_c);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_srl][0][val]);
     }
 
     byte_t SRA(byte_t val)
     {
-      static_assert((int8_t(-1) >> 1) == int8_t(-1),
-        "Arithmetic shift right is not performed");
-      bool new_c = val & 1;
-      int8_t v = val;
-      v >>= 1;
-      set_flag(v == 0, false, false, new_c);
-      return v;
+      return set_result_flags(alu_table.rotate[rot_sra][0][val]);
     }
 
     byte_t SWAP(byte_t val)
     {
-      val = (val << 4) | (val >> 4);
-      set_flag(val == 0, false, false, false);
-      return val;
+      return set_result_flags(alu_table.rotate[rot_swap][0][val]);
     }
 
     void BIT(int n, byte_t val)
     {
-      set_flag((val & (1 << n)) == 0, false, true, C());
+      set_lazy_flags(flag_op_logic, val & (1 << n), val, n, true, C());
     }
 
     byte_t SET(int n, byte_t val)
@@ -338,48 +458,44 @@ namespace gameboy
 
     byte_t DAA(byte_t val)
     {
-      // printf("[%.4hx] DAA %.2hhx with %s %s %s %s: ", reg.pc() - 1, reg.a(),
-      //   Z() ? "Z" : "-",
-      //   reg.f() & sub_flag ? "Sub" : "Add",
-      //   reg.f() & h_carry_flag ? "H" : "-",
-      //   C() ? "C" : "-");
-      // Game Boy Programming Manual pp.122
-      if (reg.f() & sub_flag)
-      {
-        // After subtraction (carry flag means borrowing)
-        if (reg.f() & h_carry_flag)
-        {
-          val -= 6;
-        }
-        if (C())
-        {
-          val -= 0x60;
-        }
-        set_flag(val == 0, reg.f() & sub_flag, false, C());
-      }
-      else
-      {
-        // After addition
-        if ((val & 0xf) > 9 || reg.f() & h_carry_flag)
-        {
-          // If last addition results in a decimal carry,
-          // add 6 more to force a correct hexadecimal carry
-          val += 6;
-        }
-        if ((val & 0xf0) > 0x90 || C())
-        {
-          val += 0x60;
-          set_flag(val == 0, reg.f() & sub_flag, false, true);
-        }
-        else
-        {
-          set_flag(val == 0, reg.f() & sub_flag, false, false);
-        }
-      }
-      // printf("%.2hhx\n", val);
-      return val;
+      // Index by N H C
+      int nhc = (reg.f() >> 4) & 0b111;
+      return set_result_flags(alu_table.daa[nhc][val]);
     }
 
+    byte_t INC_nf(byte_t val) { return val + 1; }
+    byte_t DEC_nf(byte_t val) { return val - 1; }
+    byte_t RL_nf(byte_t val) { return alu_table.rotate[rot_rl][C()][val] >> 8; }
+    byte_t RR_nf(byte_t val) { return alu_table.rotate[rot_rr][C()][val] >> 8; }
+    byte_t RRC_nf(byte_t val) { return alu_table.rotate[rot_rrc][0][val] >> 8; }
+    byte_t RLC_nf(byte_t val) { return alu_table.rotate[rot_rlc][0][val] >> 8; }
+    byte_t SWAP_nf(byte_t val) { return alu_table.rotate[rot_swap][0][val] >> 8; }
+    byte_t SLA_nf(byte_t val) { return alu_table.rotate[rot_sla][0][val] >> 8; }
+    byte_t SRL_nf(byte_t val) { return alu_table.rotate[rot_srl][0][val] >> 8; }
+    byte_t SRA_nf(byte_t val) { return alu_table.rotate[rot_sra][0][val] >> 8; }
+    byte_t CPL_nf(byte_t val) { return ~val; }
+    void CCF_nf() { }
+    void SCF_nf() { }
+
+    byte_t DAA_nf(byte_t val)
+    {
+      int nhc = (reg.f() >> 4) & 0b111;
+      return alu_table.daa[nhc][val] >> 8;
+    }
+
+    byte_t ADD_nf(byte_t v1, byte_t v2) { return v1 + v2; }
+    byte_t ADC_nf(byte_t v1, byte_t v2) { return v1 + v2 + C(); }
+    byte_t SUB_nf(byte_t v1, byte_t v2) { return v1 - v2; }
+    byte_t SBC_nf(byte_t v1, byte_t v2) { return v1 - v2 - C(); }
+    byte_t AND_nf(byte_t v1, byte_t v2) { return v1 & v2; }
+    byte_t OR_nf(byte_t v1, byte_t v2) { return v1 | v2; }
+    byte_t XOR_nf(byte_t v1, byte_t v2) { return v1 ^ v2; }
+    void CP_nf(byte_t, byte_t) { }
+    void BIT_nf(int, byte_t) { }
+
+    dbyte_t ADD_nf(dbyte_t v1, dbyte_t v2) { return v1 + v2; }
+    dbyte_t ADDSP_nf(dbyte_t v1, byte_t v2) { return add_signed(v1, v2); }
+
   };
 
   Registers::Registers()
@@ -398,10 +514,12 @@ namespace gameboy
   }
   byte_t &Registers::f()
   {
+    instruction::flush_flags();
     return AF.low;
   }
   dbyte_t &Registers::af()
   {
+    instruction::flush_flags();
     return AF.dual;
   }
 
@@ -17,12 +17,45 @@ namespace gameboy
   // Execute given instruciton, return number of clocks needed
   int exec_instruction(byte_t opcode, byte_t op8, dbyte_t op16);
 
+  // Execute one instruction with pc already increased, return clocks like
+  // exec_instruction does. Prefix cb instructions at 0x100-0x1ff.
+  typedef int (*op_handler_t)(byte_t op8, dbyte_t op16);
+  extern op_handler_t op_handler_table[512];
+
+  // Handlers which leave flags alone, the same as op_handler_table for
+  // instructions without flags, or that the run loop might stop after
+  extern op_handler_t op_handler_nf_table[512];
+
+  // Execute instructions and advance cpu_clock, until cpu_clock reaches
+  // clock_limit, an interrupt is pending or cpu leaves normal mode.
+  // At least one instruction is executed.
+  // Threaded version in instruction-set.cpp if THREADED_DISPATCH is defined,
+  // block cache version in block-cache.cpp if BLOCK_CACHE is defined,
+  // recompiled ROM version in static-rom.cpp if STATIC_ROM is defined.
+  void run_instructions(long long clock_limit);
+
   // Get the disassembly according to current pc
   std::string get_disas();
 
   // Length of each instruction, for use in fetch_instruction
   extern uint8_t instruction_length[256];
 
+  // Clocks of each instruction, the longer one for branches.
+  // 0x100-0x1ff for prefix cb.
+  extern uint8_t instruction_clocks[512];
+
+  // Whether the instruction may jump, or stop the cpu
+  extern bool instruction_is_branch[256];
+
+  // Flags (in the bits of F) the instruction depends on, and the flags it
+  // changes. 0x100-0x1ff for prefix cb.
+  extern uint8_t instruction_flags_read[512];
+  extern uint8_t instruction_flags_written[512];
+
+  // Whether the run loop might stop right after the instruction: it writes
+  // memory, branches, or changes IME or the cpu mode
+  extern bool instruction_may_stop[512];
+
   // Disassembly table
   extern const char *disas_table[512];
 
@@ -67,6 +100,33 @@ namespace gameboy
   {
     void set_flag(bool zero, bool sub, bool h_carry, bool carry);
 
+    // Flags are not packed into F right away, instead the last operation is
+    // recorded and flags are computed when they are read.
+    enum flag_op_t
+    {
+      flag_op_none, // F is up to date
+      flag_op_add, // v1 + v2 + carry
+      flag_op_sub, // v1 - v2 - carry
+      flag_op_inc, // v1 + 1, C is carry
+      flag_op_dec, // v1 - 1, C is carry
+      flag_op_logic // Z from result, N reset, H and C given
+    };
+
+    struct lazy_flags_t
+    {
+      flag_op_t op;
+      int result;
+      byte_t v1, v2;
+      bool h_carry, carry;
+    };
+
+    // Compiled code (jit-x86-64.cpp) writes it directly
+    extern lazy_flags_t lazy_flags;
+
+    // Pack the flags of the last operation into F.
+    // Registers::f() and af() call this, so F reads are always up to date.
+    void flush_flags();
+
     // Conditions
     bool Z();
     bool C();
@@ -123,6 +183,36 @@ namespace gameboy
     dbyte_t ADDSP(dbyte_t, byte_t); // Distinguish by flags
     dbyte_t DEC(dbyte_t);
     dbyte_t INC(dbyte_t);
+
+    // Same as above, but flags are left alone. Used when the flags would be
+    // overwritten before anyone reads them.
+    byte_t INC_nf(byte_t);
+    byte_t DEC_nf(byte_t);
+    byte_t RL_nf(byte_t);
+    byte_t RR_nf(byte_t);
+    byte_t RRC_nf(byte_t);
+    byte_t RLC_nf(byte_t);
+    byte_t SWAP_nf(byte_t);
+    byte_t SLA_nf(byte_t);
+    byte_t SRL_nf(byte_t);
+    byte_t SRA_nf(byte_t);
+    byte_t CPL_nf(byte_t);
+    byte_t DAA_nf(byte_t);
+    void CCF_nf();
+    void SCF_nf();
+
+    byte_t ADD_nf(byte_t, byte_t);
+    byte_t ADC_nf(byte_t, byte_t);
+    byte_t SUB_nf(byte_t, byte_t);
+    byte_t SBC_nf(byte_t, byte_t);
+    byte_t AND_nf(byte_t, byte_t);
+    byte_t OR_nf(byte_t, byte_t);
+    byte_t XOR_nf(byte_t, byte_t);
+    void CP_nf(byte_t, byte_t);
+    void BIT_nf(int, byte_t);
+
+    dbyte_t ADD_nf(dbyte_t, dbyte_t);
+    dbyte_t ADDSP_nf(dbyte_t, byte_t);
   };
 
 };
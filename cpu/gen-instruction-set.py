@@ -1,6 +1,6 @@
 """Automatically generate most of the inctruction set.
-Generate all the switch branches, and the opcode length table.
-These will be replace the anchor in exec-instr-draft"""
+Generate all the switch branches, the threaded handlers, and the opcode length
+table. These will be replace the anchor in exec-instr-draft"""
 
 def find_anchor(draft, anchor):
     "Locate the inchor string, return \
@@ -39,6 +39,51 @@ def gen_length_table(set):
         f.write('\n')
         f.write(postscript)
 
+def gen_clocks_table(set):
+    "Generate the clocks table, taking the longer time of branches"
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- The clocks will go here ---*/")
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for i in range(0, 512):
+            if i % 16 == 0:
+                f.write('\n' + indent)
+            if (set[i]['opname'] in ['UNDEF', 'PREFIX CB']):
+                f.write('0')
+            else:
+                f.write(set[i]['time'].partition('/')[0])
+            if i != 511:
+                f.write(', ')
+
+        f.write('\n')
+        f.write(postscript)
+
+# Instructions which may change the control flow
+branch_ops = ['JP', 'JR', 'CALL', 'RET', 'RETI', 'RST', 'HALT', 'STOP']
+
+def gen_branch_table(set):
+    "Generate the table of branches"
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- The branches will go here ---*/")
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for i in range(0, 256):
+            if i % 16 == 0:
+                f.write('\n' + indent)
+            if set[i]['opname'] in branch_ops:
+                f.write('1')
+            else:
+                f.write('0')
+            if i != 255:
+                f.write(', ')
+
+        f.write('\n')
+        f.write(postscript)
+
 def gen_disas(set):
     "Generate disassembly"
     with open("instruction-set.cpp", 'rt') as f:
@@ -72,8 +117,8 @@ def gen_instruction_case(set):
         f.write(foreword)
 
         for i in set:
-            # Edge cases, specified in draft
-            if i['opcode'] in [0xe8, 0xf8, 0xcb, 0xd9, 0x08]:
+            # Prefix, handled in draft
+            if i['opcode'] == 0xcb:
                 continue
 
             f.write('\n' + indent)
@@ -94,6 +139,140 @@ def gen_instruction_case(set):
 
         f.write(postscript)
 
+def threaded_label(i):
+    "Label of the threaded handler of instruction i"
+    if i['opname'] == 'UNDEF':
+        return 'op_undef'
+    elif i['opcode'] < 256:
+        return 'op_{:02x}'.format(i['opcode'])
+    else:
+        return 'op_cb_{:02x}'.format(i['opcode'] - 256)
+
+def gen_threaded_table(set):
+    "Generate the label tables of threaded dispatch"
+    for (anchor, part) in [
+        ("/*--- Threaded table will go here ---*/", set[:256]),
+        ("/*--- Threaded cb table will go here ---*/", set[256:])]:
+        with open("instruction-set.cpp", 'rt') as f:
+            draft = f.read()
+        (foreword, postscript, indent) = find_anchor(draft, anchor)
+        with open("instruction-set.cpp", 'wt') as f:
+            f.write(foreword)
+            for i in part:
+                if i['opcode'] % 8 == 0:
+                    f.write('\n' + indent)
+                else:
+                    f.write(' ')
+                f.write('&&' + threaded_label(i))
+                if i['opcode'] % 256 != 255:
+                    f.write(',')
+            f.write('\n')
+            f.write(postscript)
+
+# Operand fetch of threaded handlers, by instruction length. The run loop
+# keeps pc in a local.
+threaded_fetch = {
+    '1': [],
+    '2': ["opr8 = read_byte(pc + 1);"],
+    '3': ["opr16 = read_byte(pc + 1) |",
+          "  read_byte(pc + 2) << 8;"],
+}
+
+def gen_threaded_handler(set):
+    "Generate a handler for each instruction, which ends with DISPATCH()"
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- Threaded handlers will go here ---*/")
+
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+
+        for i in set:
+            # Prefix and undefined instructions, handled in draft
+            if i['opcode'] == 0xcb or i['opname'] == 'UNDEF':
+                continue
+
+            f.write('\n' + indent)
+            f.write("{}: // {} {}".format(
+                threaded_label(i), i['opname'], i['operand']))
+
+            lines = []
+            if i['opcode'] < 256:
+                # Prefixed instructions are fetched by the prefix
+                lines += threaded_fetch[i['len']]
+                lines.append("pc += {};".format(i['len']))
+            if i['opname'] in branch_ops:
+                # These read and set reg.pc()
+                lines.append("reg.pc() = pc;")
+                lines += format_instruction(i)
+                lines.append("pc = reg.pc();")
+            else:
+                lines += format_instruction(i)
+            for line in lines:
+                f.write('\n' + indent)
+                f.write(line)
+            f.write('\n' + indent + 'DISPATCH();\n')
+
+        f.write(postscript)
+
+def handler_name(i):
+    "Name of the handler function of instruction i"
+    if i['opname'] == 'UNDEF':
+        return 'exec_undefined'
+    elif i['opcode'] < 256:
+        return 'exec_{:02x}'.format(i['opcode'])
+    else:
+        return 'exec_cb_{:02x}'.format(i['opcode'] - 256)
+
+def gen_handler_function(set):
+    "Generate a function for each instruction, and the table of them"
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- Handler functions will go here ---*/")
+
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+
+        for i in set:
+            if i['opcode'] == 0xcb or i['opname'] == 'UNDEF':
+                continue
+
+            f.write('\n' + indent)
+            f.write("int {}(byte_t opr8, dbyte_t opr16) // {} {}".format(
+                handler_name(i), i['opname'], i['operand']))
+            f.write('\n' + indent + '{')
+            lines = ["using namespace instruction;", "int clocks;"]
+            lines += format_instruction(i)
+            lines.append("return clocks;")
+            for line in lines:
+                f.write('\n' + indent + '  ' + line)
+            f.write('\n' + indent + '}\n')
+
+        f.write(postscript)
+
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- Handler table will go here ---*/")
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for i in set:
+            if i['opcode'] % 4 == 0:
+                f.write('\n' + indent)
+            else:
+                f.write(' ')
+            # The prefix itself is never called
+            if i['opcode'] == 0xcb:
+                f.write('exec_undefined')
+            else:
+                f.write(handler_name(i))
+            if i['opcode'] != 511:
+                f.write(',')
+        f.write('\n')
+        f.write(postscript)
+
 # Replacement for each operand
 repl = {
     'A': 'reg.a()', 'F': 'reg.f()', 'B': 'reg.b()', 'C': 'reg.c()',
@@ -114,6 +293,28 @@ repl = {
     '(C)': 'mem_ref(0xff00 + reg.c())',
 }
 
+# Instructions that do not fit the patterns below
+special_cases = {
+    0x08: [ # LD (a16),SP
+        "write_dbyte(opr16, reg.sp());",
+        "clocks = 20;",
+    ],
+    0xd9: [ # RETI
+        "RET();",
+        "EI();",
+        "clocks = 16;",
+    ],
+    0xe8: [ # ADD SP,r8
+        "reg.sp() = ADDSP(reg.sp(), opr8);",
+        "clocks = 16;",
+    ],
+    0xf8: [ # LD HL,SP+r8
+        "reg.hl() = ADDSP(reg.sp(), opr8);",
+        "clocks = 12;",
+    ],
+    # STOP is coded as 10 00, here I simply ignore the second byte
+}
+
 def format_instruction(instr):
     "Format a single instruction. Return a list of lines."
     op = instr['opname']
@@ -121,7 +322,9 @@ def format_instruction(instr):
     def xlate(key):
         return repl[instr[key]]
 
-    if op in ['LD', 'LDH']:
+    if instr['opcode'] in special_cases:
+        return special_cases[instr['opcode']]
+    elif op in ['LD', 'LDH']:
         line = f"{xlate('opr1')} = {xlate('opr2')};"
     elif op in \
     ['ADD', 'ADC', 'SUB', 'SBC', 'AND', 'OR', 'XOR']:
@@ -177,13 +380,282 @@ def format_instruction(instr):
     return lines
 
 
-# Copy the draft
-with open("instruction-set-blueprint.cpp", 'rt') as src:
-    draft = src.read()
-with open("instruction-set.cpp", 'wt') as dst:
-    dst.write(draft)
+# Fused sequences used if no profile is given
+default_fused = [
+    [0x2a, 0x12], # LD A,(HL+); LD (DE),A
+    [0x05, 0x20], # DEC B; JR NZ,r8
+    [0x0d, 0x20], # DEC C; JR NZ,r8
+    [0xfe, 0x28], # CP d8; JR Z,r8
+    [0xfe, 0x20], # CP d8; JR NZ,r8
+    [0x0b, 0x78, 0xb1], # DEC BC; LD A,B; OR C
+    [0x78, 0xb1, 0x20], # LD A,B; OR C; JR NZ,r8
+    [0xf0, 0xfe, 0x20], # LDH A,(a8); CP d8; JR NZ,r8
+]
+
+# Most fused handlers taken from a profile
+max_fused = 32
+
+# Instructions after which the run loop might stop, together with those
+# writing memory (which might raise an interrupt or invalidate a block)
+stopping_ops = branch_ops + ['EI', 'DI', 'PUSH', 'PREFIX CB', 'UNDEF']
+
+def writes_memory(instr):
+    "Whether the instruction might write memory"
+    op = instr['opname']
+    if instr['opcode'] == 0x08 or op in ['PUSH', 'CALL', 'RST']:
+        return True
+    if op in ['LD', 'LDH']:
+        dst = instr['opr1']
+    elif op in ['INC', 'DEC', 'RL', 'RR', 'RRC', 'RLC', 'SWAP', 'SLA',
+        'SRL', 'SRA']:
+        dst = instr['operand']
+    elif op in ['RES', 'SET']:
+        dst = instr['opr2']
+    else:
+        return False
+    return dst.startswith('(')
+
+def may_stop(instr):
+    "Whether the run loop might stop right after the instruction"
+    return instr['opname'] in stopping_ops or writes_memory(instr)
+
+def is_fusable(set, opcodes):
+    """Whether the sequence can run in one handler. Only the last instruction
+    may write memory or change control flow, since any of those might end
+    the block or raise an interrupt."""
+    if len(opcodes) < 2 or set[opcodes[-1]]['opname'] in ['UNDEF', 'PREFIX CB']:
+        return False
+    for opcode in opcodes[:-1]:
+        if may_stop(set[opcode]):
+            return False
+    return True
+
+def load_fused(set, profile_path):
+    "Sequences to fuse, the most frequent ones in the profile if given"
+    if profile_path is None:
+        seqs = default_fused
+    else:
+        import json
+        with open(profile_path, 'rt') as f:
+            profile = json.load(f)
+        entries = profile['pairs'] + profile['triples']
+        entries.sort(key=lambda e: e['count'], reverse=True)
+        seqs = [e['ops'] for e in entries]
+    fused = []
+    for seq in seqs:
+        if is_fusable(set, seq) and seq not in fused:
+            fused.append(seq)
+    return fused[:max_fused]
+
+def fused_name(opcodes):
+    "Name of the fused handler"
+    return 'fused_' + '_'.join('{:02x}'.format(op) if op < 256
+        else 'cb_{:02x}'.format(op - 256) for op in opcodes)
+
+def dead_flag_ops(set, seq):
+    """Whether each instruction of the sequence can skip its flags: later
+    ones overwrite them before anything reads them. Flags are live after
+    the last one."""
+    live = 0xf0
+    nf = [False] * len(seq)
+    for k in reversed(range(len(seq))):
+        instr = set[seq[k]]
+        written = flags_written(instr)
+        nf[k] = k + 1 < len(seq) and written & live == 0 \
+            and has_no_flags_handler(instr)
+        live = (live & ~written) | flags_read(instr)
+    return nf
+
+def gen_fused_handler(set, fused):
+    """Generate a function for each fused sequence, and the table of them.
+    Instructions whose flags are dead within the sequence use the helpers
+    without flags."""
+    import re
+    helper_call = re.compile(r'\b(' + '|'.join(no_flags_helpers) + r')\(')
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- Fused handlers will go here ---*/")
+
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for seq in fused:
+            names = ['{} {}'.format(set[op]['opname'], set[op]['operand'])
+                for op in seq]
+            f.write('\n' + indent)
+            f.write("int {}(const micro_op_t *ops) // {}".format(
+                fused_name(seq), '; '.join(names)))
+            f.write('\n' + indent + '{')
+            lines = ["using namespace instruction;", "int clocks, total = 0;"]
+            nf = dead_flag_ops(set, seq)
+            for (k, op) in enumerate(seq):
+                lines.append(f"reg.pc() += ops[{k}].len;")
+                for line in format_instruction(set[op]):
+                    if nf[k]:
+                        line = helper_call.sub(r'\1_nf(', line)
+                    line = re.sub(r'\bopr8\b', f'ops[{k}].op8', line)
+                    line = re.sub(r'\bopr16\b', f'ops[{k}].op16', line)
+                    lines.append(line)
+                lines += ["cpu_clock += clocks;", "total += clocks;"]
+            lines.append("return total;")
+            for line in lines:
+                f.write('\n' + indent + '  ' + line)
+            f.write('\n' + indent + '}\n')
+        f.write(postscript)
+
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- Fused table will go here ---*/")
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for seq in fused:
+            opcodes = ', '.join(hex(op) for op in seq)
+            f.write('\n' + indent)
+            f.write(f"{{{len(seq)}, {{{opcodes}}}, {fused_name(seq)}}},")
+        f.write('\n')
+        f.write(postscript)
+
+
+# Flags in F
+flag_bits = {'Z': 0x80, 'N': 0x40, 'H': 0x20, 'C': 0x10}
+
+def flags_written(instr):
+    "Flags changed by the instruction, from instruction-data.json"
+    if instr['opname'] in ['UNDEF', 'PREFIX CB']:
+        return 0
+    mask = 0
+    for (flag, bit) in flag_bits.items():
+        if instr[flag] != '-':
+            mask |= bit
+    return mask
+
+def flags_read(instr):
+    """Flags the instruction depends on. Flags kept unchanged are not counted,
+    they pass through anyway."""
+    op = instr['opname']
+    if op in ['JP', 'JR', 'CALL', 'RET']:
+        cond = instr['opr1'] if instr['oprnum'] == 2 else instr['operand']
+        if cond in ['Z', 'NZ']:
+            return flag_bits['Z']
+        if cond in ['C', 'NC']:
+            return flag_bits['C']
+        return 0
+    if op in ['ADC', 'SBC', 'RL', 'RR', 'CCF']:
+        return flag_bits['C']
+    if op == 'DAA':
+        return flag_bits['N'] | flag_bits['H'] | flag_bits['C']
+    if op == 'PUSH' and instr['operand'] == 'AF':
+        return 0xf0
+    return 0
+
+def gen_flag_tables(set):
+    "Generate the flags read and written, and whether the run loop may stop"
+    for (anchor, func) in [
+        ("/*--- Flags read will go here ---*/", flags_read),
+        ("/*--- Flags written will go here ---*/", flags_written),
+        ("/*--- Stops will go here ---*/", lambda i: int(may_stop(i)))]:
+        with open("instruction-set.cpp", 'rt') as f:
+            draft = f.read()
+        (foreword, postscript, indent) = find_anchor(draft, anchor)
+        with open("instruction-set.cpp", 'wt') as f:
+            f.write(foreword)
+            for i in set:
+                if i['opcode'] % 8 == 0:
+                    f.write('\n' + indent)
+                else:
+                    f.write(' ')
+                f.write(hex(func(i)))
+                if i['opcode'] != 511:
+                    f.write(',')
+            f.write('\n')
+            f.write(postscript)
+
+# Helpers with a variant that leaves flags alone, see cpu.h
+no_flags_helpers = ['INC', 'DEC', 'ADD', 'ADC', 'SUB', 'SBC', 'AND', 'OR',
+    'XOR', 'CP', 'RL', 'RR', 'RRC', 'RLC', 'SWAP', 'SLA', 'SRL', 'SRA',
+    'CPL', 'DAA', 'BIT', 'ADDSP', 'CCF', 'SCF']
+
+def has_no_flags_handler(instr):
+    "Whether flags might ever be dropped, the run loop may not stop after it"
+    return flags_written(instr) != 0 and not may_stop(instr) \
+        and instr['opname'] != 'POP'
+
+def no_flags_handler_name(i):
+    if i['opcode'] < 256:
+        return 'exec_nf_{:02x}'.format(i['opcode'])
+    else:
+        return 'exec_nf_cb_{:02x}'.format(i['opcode'] - 256)
+
+def gen_no_flags_handler(set):
+    "Generate handlers which do not compute flags, and the table of them"
+    import re
+    helper_call = re.compile(r'\b(' + '|'.join(no_flags_helpers) + r')\(')
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- No flags handlers will go here ---*/")
+
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for i in set:
+            if not has_no_flags_handler(i):
+                continue
+            f.write('\n' + indent)
+            f.write("int {}(byte_t opr8, dbyte_t opr16) // {} {}".format(
+                no_flags_handler_name(i), i['opname'], i['operand']))
+            f.write('\n' + indent + '{')
+            lines = ["using namespace instruction;", "int clocks;"]
+            lines += [helper_call.sub(r'\1_nf(', line)
+                for line in format_instruction(i)]
+            lines.append("return clocks;")
+            for line in lines:
+                f.write('\n' + indent + '  ' + line)
+            f.write('\n' + indent + '}\n')
+        f.write(postscript)
+
+    with open("instruction-set.cpp", 'rt') as f:
+        draft = f.read()
+    (foreword, postscript, indent) = \
+    find_anchor(draft, "/*--- No flags table will go here ---*/")
+    with open("instruction-set.cpp", 'wt') as f:
+        f.write(foreword)
+        for i in set:
+            if i['opcode'] % 4 == 0:
+                f.write('\n' + indent)
+            else:
+                f.write(' ')
+            if i['opcode'] == 0xcb:
+                f.write('exec_undefined')
+            elif has_no_flags_handler(i):
+                f.write(no_flags_handler_name(i))
+            else:
+                f.write(handler_name(i))
+            if i['opcode'] != 511:
+                f.write(',')
+        f.write('\n')
+        f.write(postscript)
+
+
+if __name__ == '__main__':
+    # Copy the draft
+    with open("instruction-set-blueprint.cpp", 'rt') as src:
+        draft = src.read()
+    with open("instruction-set.cpp", 'wt') as dst:
+        dst.write(draft)
 
-ins_set = load_instruction_set()
-gen_length_table(ins_set)
-gen_disas(ins_set)
-gen_instruction_case(ins_set)
+    ins_set = load_instruction_set()
+    gen_length_table(ins_set)
+    gen_clocks_table(ins_set)
+    gen_branch_table(ins_set)
+    gen_disas(ins_set)
+    gen_instruction_case(ins_set)
+    gen_threaded_table(ins_set)
+    gen_threaded_handler(ins_set)
+    gen_handler_function(ins_set)
+    gen_flag_tables(ins_set)
+    gen_no_flags_handler(ins_set)
+    # An opcode profile recorded with PROFILE_OPCODES might be given
+    import sys
+    gen_fused_handler(ins_set,
+        load_fused(ins_set, sys.argv[1] if len(sys.argv) > 1 else None))
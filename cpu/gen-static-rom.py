@@ -0,0 +1,150 @@
+"""Recompile the code of a ROM into C++ ahead of time.
+Usage: gen-static-rom.py rom.gb output.cpp
+Code is followed from 0x100 and the RST and interrupt vectors. Each block
+(up to a branch or the end of a bank) becomes a function, made of the
+same lines as the handlers of gen-instruction-set.py with the operands as
+constants. Only banks 0 and 1 are recompiled.
+Anything not found here (jumps through HL, code in RAM) is left to the
+interpreter, see static-rom.h."""
+
+import importlib
+import re
+import sys
+
+gen = importlib.import_module('gen-instruction-set')
+
+# Where execution might begin
+entry_points = [0x100] + list(range(0, 0x40, 8)) + list(range(0x40, 0x68, 8))
+
+def hash_rom(rom):
+    "FNV-1a, same as the emulator"
+    h = 0xcbf29ce484222325
+    for b in rom:
+        h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+def decode(set, rom, addr):
+    """Decode the instruction at addr, return (instruction, length, opr8,
+    opr16), or None if it is undefined or leaves the ROM"""
+    limit = min(len(rom), 0x8000)
+    if addr >= limit:
+        return None
+    instr = set[rom[addr]]
+    if instr['opname'] == 'UNDEF':
+        return None
+    length = int(instr['len'])
+    if addr + length > limit:
+        return None
+    opr8 = rom[addr + 1] if length >= 2 else 0
+    opr16 = rom[addr + 1] | rom[addr + 2] << 8 if length == 3 else 0
+    if rom[addr] == 0xcb:
+        instr = set[0x100 + opr8]
+    return (instr, length, opr8, opr16)
+
+def successors(instr, addr, length, opr8, opr16):
+    "Addresses execution might go to after the last instruction of a block"
+    op = instr['opname']
+    next_addr = addr + length
+    conditional = instr['oprnum'] == 2 or \
+        (op == 'RET' and instr['operand'] != '')
+    if op == 'JP':
+        if instr['operand'] == '(HL)':
+            return []
+        return [opr16, next_addr] if conditional else [opr16]
+    if op == 'JR':
+        target = (next_addr + (opr8 - 256 if opr8 >= 128 else opr8)) & 0xffff
+        return [target, next_addr] if conditional else [target]
+    if op == 'CALL':
+        return [opr16, next_addr]
+    if op == 'RST':
+        return [int(instr['operand'][:-1], 16), next_addr]
+    if op in ['RET', 'RETI']:
+        return [next_addr] if conditional else []
+    # HALT, STOP
+    return [next_addr]
+
+def find_blocks(set, rom):
+    """Follow the reachable code, return
+    {begin: [(instr, addr, length, opr8, opr16)]}"""
+    blocks = {}
+    work = list(entry_points)
+    while work:
+        begin = work.pop()
+        if begin in blocks or begin >= 0x8000:
+            continue
+        block = []
+        addr = begin
+        while True:
+            decoded = decode(set, rom, addr)
+            if decoded is None:
+                # Let the interpreter deal with it
+                break
+            (instr, length, opr8, opr16) = decoded
+            block.append((instr, addr, length, opr8, opr16))
+            if instr['opcode'] < 256 and instr['opname'] in gen.branch_ops:
+                work += successors(instr, addr, length, opr8, opr16)
+                break
+            addr += length
+            if addr // 0x4000 != begin // 0x4000:
+                # Bank 1 is checked when a block begins, stay in one bank
+                work.append(addr)
+                break
+        blocks[begin] = block
+    return blocks
+
+def format_static(instr, addr, length, opr8, opr16):
+    "Lines of one instruction, with pc and operands known"
+    lines = [f"// {instr['opname']} {instr['operand']}",
+        "reg.pc() = {:#06x};".format((addr + length) & 0xffff)]
+    for line in gen.format_instruction(instr):
+        line = re.sub(r'\bopr8\b', '{:#04x}'.format(opr8), line)
+        line = re.sub(r'\bopr16\b', '{:#06x}'.format(opr16), line)
+        lines.append(line)
+    lines.append("cpu_clock += clocks;")
+    lines.append("STATIC_CHECK();")
+    return lines
+
+def gen_static_rom(rom_path, out_path):
+    with open(rom_path, 'rb') as f:
+        rom = f.read()
+    set = gen.load_instruction_set()
+    blocks = find_blocks(set, rom)
+    begins = [begin for begin in sorted(blocks) if blocks[begin]]
+
+    with open(out_path, 'wt') as f:
+        f.write("// Generated by gen-static-rom.py from {}\n".format(
+            rom_path.split('/')[-1]))
+        f.write('\n#include "static-rom.h"\n#include "cpu.h"\n'
+            '#include "../main/threads.h"\n\n')
+        f.write('// Same stop condition as the interpreter\n')
+        f.write('#define STATIC_CHECK() \\\n'
+            '  if (cpu_clock >= clock_limit || interrupt_address \\\n'
+            '    || cpu_mode != cpu_mode_normal) \\\n'
+            '    return false\n\n')
+        f.write('namespace gameboy\n{\n')
+        f.write('  const unsigned long long static_rom_hash = '
+            '{:#018x}ull;\n'.format(hash_rom(rom)))
+        for begin in begins:
+            f.write('\n  bool static_block_{:04x}(long long clock_limit)\n'
+                .format(begin))
+            f.write('  {\n')
+            f.write('    using namespace instruction;\n')
+            f.write('    int clocks;\n')
+            for decoded in blocks[begin]:
+                for line in format_static(*decoded):
+                    f.write('    ' + line + '\n')
+            f.write('    return true;\n')
+            f.write('  }\n')
+        f.write('\n  const static_block_entry_t static_blocks[] =\n  {\n')
+        for begin in begins:
+            f.write('    {{{:#06x}, static_block_{:04x}}},\n'.format(
+                begin, begin))
+        f.write('    {0, nullptr}\n')
+        f.write('  };\n};\n')
+    print('{} blocks recompiled'.format(len(begins)))
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    gen_static_rom(sys.argv[1], sys.argv[2])
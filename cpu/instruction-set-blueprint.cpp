@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include "cpu.h"
+#include "block-cache.h"
+#include "../main/threads.h"
 
 namespace gameboy
 {
@@ -10,6 +12,31 @@ namespace gameboy
     /*--- The data will go here ---*/
   };
 
+  uint8_t instruction_clocks[512] =
+  {
+    /*--- The clocks will go here ---*/
+  };
+
+  bool instruction_is_branch[256] =
+  {
+    /*--- The branches will go here ---*/
+  };
+
+  uint8_t instruction_flags_read[512] =
+  {
+    /*--- Flags read will go here ---*/
+  };
+
+  uint8_t instruction_flags_written[512] =
+  {
+    /*--- Flags written will go here ---*/
+  };
+
+  bool instruction_may_stop[512] =
+  {
+    /*--- Stops will go here ---*/
+  };
+
   const char *disas_table[512] =
   {
     /*--- The disas will go here ---*/
@@ -32,28 +59,6 @@ namespace gameboy
     {
       // case 0xcb: // See above
 
-      case 0x08: // LD (a16), SP
-      write_dbyte(opr16, reg.sp());
-      clocks = 20;
-      break;
-
-      case 0xd9: // RETI
-      RET();
-      EI();
-      clocks = 16;
-      break;
-
-      case 0xe8: // ADD SP,r8
-      reg.sp() = ADDSP(reg.sp(), opr8);
-      break;
-
-      case 0xf8: // LD HL,SP+r8
-      reg.hl() = ADDSP(reg.sp(), opr8);
-      break;
-
-      // case 0x10: // STOP
-      // STOP is coded as 10 00, here I simply ignore the second byte
-
       /*--- More cases will go here ---*/
 
       default:
@@ -63,4 +68,84 @@ namespace gameboy
     return clocks;
   }
 
+  int exec_undefined(byte_t opr8, dbyte_t opr16)
+  {
+    // Same as exec_instruction
+    return -1;
+  }
+
+  /*--- Handler functions will go here ---*/
+
+  op_handler_t op_handler_table[512] =
+  {
+    /*--- Handler table will go here ---*/
+  };
+
+  /*--- No flags handlers will go here ---*/
+
+  op_handler_t op_handler_nf_table[512] =
+  {
+    /*--- No flags table will go here ---*/
+  };
+
+  /*--- Fused handlers will go here ---*/
+
+  const fused_op_t fused_ops[] =
+  {
+    /*--- Fused table will go here ---*/
+    {0, {}, nullptr}
+  };
+
+#ifdef THREADED_DISPATCH
+  // Direct threaded: every handler fetches its own operands, then jumps
+  // straight to the handler of the next instruction (gcc computed goto).
+  // pc stays in a local, and goes to reg only around branches and on exit.
+  void run_instructions(long long clock_limit)
+  {
+    static void *const dispatch_table[256] =
+    {
+      /*--- Threaded table will go here ---*/
+    };
+    static void *const dispatch_table_cb[256] =
+    {
+      /*--- Threaded cb table will go here ---*/
+    };
+
+    byte_t opr8;
+    dbyte_t opr16;
+    int clocks;
+    dbyte_t pc = reg.pc();
+
+    using namespace instruction;
+
+    // Same stop condition as the loop in cpu.cpp
+#define DISPATCH() \
+    cpu_clock += clocks; \
+    if (cpu_clock >= clock_limit || interrupt_address \
+      || cpu_mode != cpu_mode_normal) \
+    { \
+      reg.pc() = pc; \
+      return; \
+    } \
+    goto *dispatch_table[read_byte(pc)]
+
+    goto *dispatch_table[read_byte(pc)];
+
+    op_cb:
+    opr8 = read_byte(pc + 1);
+    pc += 2;
+    goto *dispatch_table_cb[opr8];
+
+    op_undef:
+    // Same as exec_instruction
+    cpu_clock -= 1;
+    reg.pc() = pc;
+    return;
+
+    /*--- Threaded handlers will go here ---*/
+
+#undef DISPATCH
+  }
+#endif
+
 };
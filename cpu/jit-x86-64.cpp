@@ -0,0 +1,781 @@
+// Loads, 8-bit arithmetic, INC/DEC and the jump ending the block are
+// translated inline. The 8-bit registers live in host registers meanwhile,
+// and inline arithmetic writes lazy_flags the way the handlers do. Other
+// instructions (memory, stack, prefix cb) become a call to their handler
+// (without dead flags) with the operands as immediates, so the registers
+// are stored to reg before and loaded again after. pc is known at each
+// instruction, and only stored before calls and at the end.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "jit-x86-64.h"
+#include "block-cache.h"
+#include "cpu.h"
+#include "../main/threads.h"
+#include "../main/idle-loop.h"
+
+#if defined(JIT) && defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+namespace gameboy
+{
+  long long jit_clocks;
+  unsigned jit_generation;
+
+#if defined(JIT) && defined(__x86_64__) && !defined(_WIN32)
+  // Executable buffer, flushed when full
+  const size_t code_capacity = 4 << 20;
+  byte_t *code_buffer;
+  size_t code_used;
+  // Set if mmap fails, never try again
+  bool jit_failed;
+
+  typedef std::vector<byte_t> code_t;
+
+  void emit8(code_t &code, uint8_t val)
+  {
+    code.push_back(val);
+  }
+
+  void emit16(code_t &code, uint16_t val)
+  {
+    emit8(code, val);
+    emit8(code, val >> 8);
+  }
+
+  void emit32(code_t &code, uint32_t val)
+  {
+    emit16(code, val);
+    emit16(code, val >> 16);
+  }
+
+  void emit64(code_t &code, uint64_t val)
+  {
+    emit32(code, val);
+    emit32(code, val >> 32);
+  }
+
+  void emit_bytes(code_t &code, std::initializer_list<uint8_t> bytes)
+  {
+    code.insert(code.end(), bytes);
+  }
+
+  // Host registers, numbered as in the instruction encoding
+  enum host_reg_t
+  {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15
+  };
+
+  // Condition codes of jcc and setcc
+  enum host_cond_t
+  {
+    cond_e = 0x4, cond_ne = 0x5, cond_l = 0xc, cond_ge = 0xd
+  };
+
+  // Extension of the group 1 instructions (0x81 /ext), the register form
+  // is ext * 8 + 1
+  enum host_alu_t
+  {
+    alu_add = 0, alu_or = 1, alu_and = 4, alu_sub = 5, alu_xor = 6, alu_cmp = 7
+  };
+
+  // Host register of the 8-bit registers in the order of opcode encoding:
+  // B C D E H L (HL) A, -1 for (HL). All caller-saved, so they are stored
+  // before calls and loaded again when used after.
+  const int host_reg8[8] = {r9, r10, r11, rsi, rdi, rdx, -1, r8};
+
+  // REX prefix if needed. Byte registers spl-dil need one too.
+  void emit_rex(code_t &code, int reg, int rm, bool byte)
+  {
+    uint8_t rex = 0x40 | (reg >> 3) << 2 | rm >> 3;
+    if (rex != 0x40 || byte)
+      emit8(code, rex);
+  }
+
+  // opcode reg, rm with both registers
+  void emit_rr(code_t &code, std::initializer_list<uint8_t> opcode, int reg,
+    int rm, bool byte = false)
+  {
+    emit_rex(code, reg, rm, byte);
+    emit_bytes(code, opcode);
+    emit8(code, 0xc0 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  // opcode reg, [base + disp8]
+  void emit_rm(code_t &code, std::initializer_list<uint8_t> opcode, int reg,
+    int base, int disp, bool byte = false)
+  {
+    emit_rex(code, reg, base, byte);
+    emit_bytes(code, opcode);
+    emit8(code, 0x40 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == rsp)
+    {
+      // SIB without index
+      emit8(code, 0x24);
+    }
+    emit8(code, disp);
+  }
+
+  // mov dst, imm32
+  void emit_mov_imm(code_t &code, int dst, uint32_t imm)
+  {
+    emit_rex(code, 0, dst, false);
+    emit8(code, 0xb8 | (dst & 7));
+    emit32(code, imm);
+  }
+
+  // op dst, src (32-bit)
+  void emit_alu(code_t &code, host_alu_t alu, int dst, int src)
+  {
+    emit_rr(code, {uint8_t(alu * 8 + 1)}, src, dst);
+  }
+
+  // op dst, imm32
+  void emit_alu_imm(code_t &code, host_alu_t alu, int dst, uint32_t imm)
+  {
+    emit_rr(code, {0x81}, alu, dst);
+    emit32(code, imm);
+  }
+
+  // movzx dst, src8
+  void emit_movzx(code_t &code, int dst, int src)
+  {
+    emit_rr(code, {0x0f, 0xb6}, dst, src, true);
+  }
+
+  // jcc rel32 (jmp if cond < 0), returns the position to patch
+  size_t emit_jump(code_t &code, int cond)
+  {
+    if (cond < 0)
+    {
+      emit8(code, 0xe9);
+    }
+    else
+    {
+      emit_bytes(code, {0x0f, uint8_t(0x80 | cond)});
+    }
+    emit32(code, 0);
+    return code.size() - 4;
+  }
+
+  // Point the jump at pos to the end of code
+  void patch_jump(code_t &code, size_t pos)
+  {
+    uint32_t rel = code.size() - (pos + 4);
+    memcpy(&code[pos], &rel, 4);
+  }
+
+  // r12 holds &reg, registers are addressed as [r12 + offset]
+  int reg_offset(const void *field)
+  {
+    return static_cast<const byte_t *>(field)
+      - reinterpret_cast<const byte_t *>(&reg);
+  }
+
+  // r13 holds &lazy_flags
+  const int lazy_op = offsetof(instruction::lazy_flags_t, op);
+  const int lazy_result = offsetof(instruction::lazy_flags_t, result);
+  const int lazy_v1 = offsetof(instruction::lazy_flags_t, v1);
+  const int lazy_v2 = offsetof(instruction::lazy_flags_t, v2);
+  const int lazy_h_carry = offsetof(instruction::lazy_flags_t, h_carry);
+  const int lazy_carry = offsetof(instruction::lazy_flags_t, carry);
+
+  // Offset of the 8-bit register in the order of opcode encoding
+  int reg8_offset(int ind)
+  {
+    switch (ind)
+    {
+      case 0: return reg_offset(&reg.b());
+      case 1: return reg_offset(&reg.c());
+      case 2: return reg_offset(&reg.d());
+      case 3: return reg_offset(&reg.e());
+      case 4: return reg_offset(&reg.h());
+      case 5: return reg_offset(&reg.l());
+      default: return reg_offset(&reg.a());
+    }
+  }
+
+  // What the code compiled so far leaves behind
+  struct jit_state_t
+  {
+    code_t code;
+    // The 8-bit register is in its host register, and changed there
+    bool loaded[8], dirty[8];
+    // Clocks of inline instructions not added to rbx and cpu_clock yet
+    int pending_clocks;
+    // The operation in lazy_flags, -1 if not known (before the first
+    // inline operation that writes flags, and after calls)
+    int flag_op;
+  };
+
+  // Host register holding the 8-bit register, loaded if needed
+  int use_reg8(jit_state_t &s, int ind)
+  {
+    int host = host_reg8[ind];
+    if (!s.loaded[ind])
+    {
+      // movzx host, byte [r12 + offset]
+      emit_rm(s.code, {0x0f, 0xb6}, host, r12, reg8_offset(ind));
+      s.loaded[ind] = true;
+    }
+    return host;
+  }
+
+  // Host register the 8-bit register is about to be written to
+  int def_reg8(jit_state_t &s, int ind)
+  {
+    s.loaded[ind] = true;
+    s.dirty[ind] = true;
+    return host_reg8[ind];
+  }
+
+  // Store the changed registers to reg, before calls and at the end
+  void spill_regs(jit_state_t &s)
+  {
+    for (int ind = 0; ind < 8; ind++)
+    {
+      if (s.dirty[ind])
+      {
+        // mov byte [r12 + offset], host
+        emit_rm(s.code, {0x88}, host_reg8[ind], r12, reg8_offset(ind), true);
+      }
+      s.loaded[ind] = false;
+      s.dirty[ind] = false;
+    }
+  }
+
+  void add_clocks(code_t &code, int clocks)
+  {
+    // add rbx, clocks
+    emit_bytes(code, {0x48, 0x81, 0xc3});
+    emit32(code, clocks);
+    // mov rcx, &cpu_clock; add qword [rcx], clocks
+    emit_bytes(code, {0x48, 0xb9});
+    emit64(code, reinterpret_cast<uint64_t>(&cpu_clock));
+    emit_bytes(code, {0x48, 0x81, 0x01});
+    emit32(code, clocks);
+  }
+
+  // Inline instructions don't read cpu_clock, it only has to be up to date
+  // for calls and at the end
+  void flush_clocks(jit_state_t &s)
+  {
+    if (s.pending_clocks != 0)
+    {
+      add_clocks(s.code, s.pending_clocks);
+      s.pending_clocks = 0;
+    }
+  }
+
+  void emit_store_pc(code_t &code, dbyte_t pc)
+  {
+    // mov word [r12 + pc], pc
+    emit_bytes(code, {0x66, 0x41, 0xc7, 0x44, 0x24,
+      uint8_t(reg_offset(&reg.pc()))});
+    emit16(code, pc);
+  }
+
+  // ecx = Z or C, as Z() and C() compute them when lazy_flags holds op
+  void emit_flag_of(code_t &code, int op, bool carry)
+  {
+    switch (op)
+    {
+      case instruction::flag_op_add:
+      case instruction::flag_op_sub:
+      // xor ecx, ecx; cmp dword [r13 + result], imm32; setcc cl
+      emit_alu(code, alu_xor, rcx, rcx);
+      emit_rm(code, {0x81}, alu_cmp, r13, lazy_result);
+      emit32(code, carry && op == instruction::flag_op_add ? 0x100 : 0);
+      emit_bytes(code, {0x0f, uint8_t(0x90 | (!carry ? cond_e
+        : op == instruction::flag_op_add ? cond_ge : cond_l)), 0xc1});
+      break;
+
+      case instruction::flag_op_inc:
+      case instruction::flag_op_dec:
+      case instruction::flag_op_logic:
+      if (carry)
+      {
+        // movzx ecx, byte [r13 + carry]
+        emit_rm(code, {0x0f, 0xb6}, rcx, r13, lazy_carry);
+        break;
+      }
+      // xor ecx, ecx; cmp byte [r13 + v1 or result], imm8; sete cl
+      emit_alu(code, alu_xor, rcx, rcx);
+      emit_rm(code, {0x80}, alu_cmp, r13,
+        op == instruction::flag_op_logic ? lazy_result : lazy_v1);
+      emit8(code, op == instruction::flag_op_inc ? 0xff
+        : op == instruction::flag_op_dec ? 1 : 0);
+      emit_bytes(code, {0x0f, 0x90 | cond_e, 0xc1});
+      break;
+
+      default:
+      // movzx ecx, byte [r12 + f]; shr ecx, 4 or 7; and ecx, 1
+      emit_rm(code, {0x0f, 0xb6}, rcx, r12, reg_offset(&reg.f()));
+      emit_rr(code, {0xc1}, 5, rcx);
+      emit8(code, carry ? 4 : 7);
+      emit_alu_imm(code, alu_and, rcx, 1);
+      break;
+    }
+  }
+
+  // ecx = Z or C, clobbers eax. Dispatches on lazy_flags.op at run time,
+  // unless an inline instruction of this block wrote it.
+  void emit_flag(jit_state_t &s, bool carry)
+  {
+    if (s.flag_op >= 0)
+    {
+      emit_flag_of(s.code, s.flag_op, carry);
+      return;
+    }
+    std::vector<size_t> done;
+    // mov eax, [r13 + op]
+    emit_rm(s.code, {0x8b}, rax, r13, lazy_op);
+    for (int op = instruction::flag_op_add; op <= instruction::flag_op_logic;
+      op++)
+    {
+      // cmp eax, op; jne next
+      emit_rr(s.code, {0x83}, alu_cmp, rax);
+      emit8(s.code, op);
+      size_t next = emit_jump(s.code, cond_ne);
+      emit_flag_of(s.code, op, carry);
+      done.push_back(emit_jump(s.code, -1));
+      patch_jump(s.code, next);
+    }
+    emit_flag_of(s.code, instruction::flag_op_none, carry);
+    for (size_t pos : done)
+    {
+      patch_jump(s.code, pos);
+    }
+  }
+
+  // Store the operation to lazy_flags as set_lazy_flags does: result in
+  // eax, v2 in a register or imm if v2 < 0, carry from ecx if carry_in
+  void emit_lazy_flags(jit_state_t &s, instruction::flag_op_t op, int v1,
+    int v2, byte_t imm, bool h_carry, bool carry_in)
+  {
+    code_t &code = s.code;
+    // mov dword [r13 + op], op
+    emit_rm(code, {0xc7}, 0, r13, lazy_op);
+    emit32(code, op);
+    // mov [r13 + result], eax
+    emit_rm(code, {0x89}, rax, r13, lazy_result);
+    // mov [r13 + v1], v1
+    emit_rm(code, {0x88}, v1, r13, lazy_v1, true);
+    if (v2 >= 0)
+    {
+      // mov [r13 + v2], v2
+      emit_rm(code, {0x88}, v2, r13, lazy_v2, true);
+    }
+    else
+    {
+      // mov byte [r13 + v2], imm
+      emit_rm(code, {0xc6}, 0, r13, lazy_v2);
+      emit8(code, imm);
+    }
+    // mov byte [r13 + h_carry], h_carry
+    emit_rm(code, {0xc6}, 0, r13, lazy_h_carry);
+    emit8(code, h_carry);
+    if (carry_in)
+    {
+      // mov [r13 + carry], cl
+      emit_rm(code, {0x88}, rcx, r13, lazy_carry);
+    }
+    else
+    {
+      // mov byte [r13 + carry], 0
+      emit_rm(code, {0xc6}, 0, r13, lazy_carry);
+      emit8(code, 0);
+    }
+    s.flag_op = op;
+  }
+
+  // ADD ADC SUB SBC AND XOR OR CP, with A and src (an 8-bit register, or
+  // the immediate if src < 0)
+  void emit_alu8(jit_state_t &s, int kind, int src, byte_t imm, bool live)
+  {
+    using namespace instruction;
+    code_t &code = s.code;
+    bool with_carry = kind == 1 || kind == 3;
+    if (with_carry)
+    {
+      emit_flag(s, true);
+    }
+    int a = use_reg8(s, 7);
+    int v2 = src >= 0 ? use_reg8(s, src) : -1;
+
+    // mov eax, a; op eax, v2; add/sub eax, ecx
+    emit_rr(code, {0x89}, a, rax);
+    static const host_alu_t host_alu[8] = {alu_add, alu_add, alu_sub, alu_sub,
+      alu_and, alu_xor, alu_or, alu_sub};
+    if (v2 >= 0)
+    {
+      emit_alu(code, host_alu[kind], rax, v2);
+    }
+    else
+    {
+      emit_alu_imm(code, host_alu[kind], rax, imm);
+    }
+    if (with_carry)
+    {
+      emit_alu(code, host_alu[kind], rax, rcx);
+    }
+
+    if (live)
+    {
+      flag_op_t op = kind < 2 ? flag_op_add : kind < 4 || kind == 7
+        ? flag_op_sub : flag_op_logic;
+      emit_lazy_flags(s, op, a, v2, imm, kind == 4, with_carry);
+    }
+    if (kind != 7)
+    {
+      emit_movzx(code, def_reg8(s, 7), rax);
+    }
+  }
+
+  // INC r, DEC r
+  void emit_inc_dec8(jit_state_t &s, int ind, bool dec, bool live)
+  {
+    code_t &code = s.code;
+    if (live)
+    {
+      // C is kept
+      emit_flag(s, true);
+    }
+    int r = use_reg8(s, ind);
+    // mov eax, r; add/sub eax, 1
+    emit_rr(code, {0x89}, r, rax);
+    emit_alu_imm(code, dec ? alu_sub : alu_add, rax, 1);
+    if (live)
+    {
+      emit_lazy_flags(s, dec ? instruction::flag_op_dec
+        : instruction::flag_op_inc, r, -1, 1, false, true);
+    }
+    emit_movzx(code, def_reg8(s, ind), rax);
+  }
+
+  // INC rr, DEC rr of BC DE HL, on both halves in host registers
+  void emit_inc_dec16(jit_state_t &s, int pair, bool dec)
+  {
+    code_t &code = s.code;
+    int hi = use_reg8(s, pair * 2);
+    int lo = use_reg8(s, pair * 2 + 1);
+    // mov eax, hi; shl eax, 8; or eax, lo; add/sub eax, 1
+    emit_rr(code, {0x89}, hi, rax);
+    emit_rr(code, {0xc1}, 4, rax);
+    emit8(code, 8);
+    emit_alu(code, alu_or, rax, lo);
+    emit_alu_imm(code, dec ? alu_sub : alu_add, rax, 1);
+    // movzx lo, al; shr eax, 8; movzx hi, al
+    emit_movzx(code, def_reg8(s, pair * 2 + 1), rax);
+    emit_rr(code, {0xc1}, 5, rax);
+    emit8(code, 8);
+    emit_movzx(code, def_reg8(s, pair * 2), rax);
+  }
+
+  // Translate the instruction without calling out, return false if not
+  // supported. Clocks are counted by the caller.
+  bool emit_inline(jit_state_t &s, const micro_op_t &op)
+  {
+    byte_t opcode = op.opcode;
+    // Flags are written unless drop_dead_flags found them unused
+    bool live = op.fast_handler == op.handler;
+    if (opcode == 0x00)
+    {
+      // NOP
+      return true;
+    }
+    else if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76)
+    {
+      // LD r,r
+      int dst = (opcode >> 3) & 7, src = opcode & 7;
+      if (dst == 6 || src == 6)
+        return false;
+      int host = use_reg8(s, src);
+      // mov dst, src
+      emit_rr(s.code, {0x89}, host, def_reg8(s, dst));
+      return true;
+    }
+    else if (opcode < 0x40 && (opcode & 7) == 6)
+    {
+      // LD r,d8
+      if (opcode >> 3 == 6)
+        return false;
+      emit_mov_imm(s.code, def_reg8(s, opcode >> 3), op.op8);
+      return true;
+    }
+    else if (opcode < 0x40 && (opcode & 7) >= 4 && (opcode & 7) <= 5)
+    {
+      // INC r, DEC r
+      if (opcode >> 3 == 6)
+        return false;
+      emit_inc_dec8(s, opcode >> 3, opcode & 1, live);
+      return true;
+    }
+    else if (opcode >= 0x80 && opcode < 0xc0)
+    {
+      // ALU A,r
+      if ((opcode & 7) == 6)
+        return false;
+      emit_alu8(s, (opcode >> 3) & 7, opcode & 7, 0, live);
+      return true;
+    }
+    else if (opcode >= 0xc0 && (opcode & 7) == 6)
+    {
+      // ALU A,d8
+      emit_alu8(s, (opcode >> 3) & 7, -1, op.op8, live);
+      return true;
+    }
+    else if (opcode == 0x31)
+    {
+      // LD SP,d16
+      // mov word [r12 + sp], imm16
+      emit_bytes(s.code, {0x66, 0x41, 0xc7, 0x44, 0x24,
+        uint8_t(reg_offset(&reg.sp()))});
+      emit16(s.code, op.op16);
+      return true;
+    }
+    else if (opcode < 0x40 && (opcode & 0xf) == 1)
+    {
+      // LD rr,d16
+      int pair = opcode >> 4;
+      emit_mov_imm(s.code, def_reg8(s, pair * 2), op.op16 >> 8);
+      emit_mov_imm(s.code, def_reg8(s, pair * 2 + 1), op.op16 & 0xff);
+      return true;
+    }
+    else if (opcode == 0x33 || opcode == 0x3b)
+    {
+      // INC SP, DEC SP
+      // inc/dec word [r12 + sp]
+      emit_bytes(s.code, {0x66, 0x41, 0xff,
+        uint8_t(opcode == 0x33 ? 0x44 : 0x4c), 0x24,
+        uint8_t(reg_offset(&reg.sp()))});
+      return true;
+    }
+    else if (opcode < 0x40 && ((opcode & 0xf) == 3 || (opcode & 0xf) == 0xb))
+    {
+      // INC rr, DEC rr
+      emit_inc_dec16(s, opcode >> 4, opcode & 8);
+      return true;
+    }
+    return false;
+  }
+
+  // Whether the instruction is JR or JP with an immediate target
+  bool is_direct_jump(byte_t opcode)
+  {
+    return opcode == 0x18 || (opcode >= 0x20 && opcode < 0x40
+      && (opcode & 7) == 0) || opcode == 0xc3 || (opcode >= 0xc2
+      && opcode < 0xe0 && (opcode & 7) == 2);
+  }
+
+  // JR and JP (cc) ending the block, pc is the address after it. Like JR()
+  // and JP(), a jump back checks for an idle loop.
+  void emit_jump_op(jit_state_t &s, const micro_op_t &op, dbyte_t pc)
+  {
+    code_t &code = s.code;
+    byte_t opcode = op.opcode;
+    bool relative = opcode < 0x40;
+    dbyte_t target = relative ? add_signed(pc, op.op8) : op.op16;
+    bool conditional = opcode != 0x18 && opcode != 0xc3;
+    // The table has the clocks of the jump taken, 4 more than not taken
+    int clocks = instruction_clocks[opcode];
+
+    spill_regs(s);
+    flush_clocks(s);
+    size_t not_taken = 0;
+    if (conditional)
+    {
+      // NZ Z NC C
+      int cond = (opcode >> 3) & 3;
+      emit_flag(s, cond >= 2);
+      // test ecx, ecx; jump if the condition does not hold
+      emit_rr(code, {0x85}, rcx, rcx);
+      not_taken = emit_jump(code, cond & 1 ? cond_e : cond_ne);
+    }
+
+    emit_store_pc(code, target);
+    if (target < pc)
+    {
+      // mov edi, pc; mov rax, check_idle_loop; call rax
+      emit8(code, 0xbf);
+      emit32(code, pc);
+      emit_bytes(code, {0x48, 0xb8});
+      emit64(code, reinterpret_cast<uint64_t>(&check_idle_loop));
+      emit_bytes(code, {0xff, 0xd0});
+    }
+    add_clocks(code, clocks);
+
+    if (conditional)
+    {
+      size_t done = emit_jump(code, -1);
+      patch_jump(code, not_taken);
+      emit_store_pc(code, pc);
+      add_clocks(code, clocks - 4);
+      patch_jump(code, done);
+    }
+  }
+
+  // Copy the code to the buffer, which is only writable meanwhile
+  byte_t *install_code(const code_t &code)
+  {
+    if (code_buffer == nullptr)
+    {
+      void *buf = mmap(NULL, code_capacity, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf == MAP_FAILED)
+      {
+        printf("Unable to allocate buffer for JIT, fall back to interpreter.\n");
+        jit_failed = true;
+        return nullptr;
+      }
+      code_buffer = static_cast<byte_t *>(buf);
+    }
+    else if (mprotect(code_buffer, code_capacity, PROT_READ | PROT_WRITE) != 0)
+    {
+      printf("Unable to write to the JIT buffer, fall back to interpreter.\n");
+      jit_failed = true;
+      return nullptr;
+    }
+
+    if (code_used + code.size() > code_capacity)
+    {
+      // Flush all the code, blocks are compiled again when they get hot
+      jit_generation++;
+      code_used = 0;
+    }
+    byte_t *dst = code_buffer + code_used;
+    memcpy(dst, code.data(), code.size());
+    code_used += code.size();
+
+    if (mprotect(code_buffer, code_capacity, PROT_READ | PROT_EXEC) != 0)
+    {
+      printf("Unable to execute the JIT buffer, fall back to interpreter.\n");
+      // Drop the compiled blocks, none of them can run
+      jit_generation++;
+      jit_failed = true;
+      return nullptr;
+    }
+    return dst;
+  }
+
+  native_block_t compile_block(const block_t &block)
+  {
+    if (jit_failed)
+      return nullptr;
+
+    jit_state_t s = {};
+    s.flag_op = -1;
+    code_t &code = s.code;
+    // Jumps to be patched to the exit
+    std::vector<size_t> exits;
+
+    // push rbx; push r12; push r13 (leaves the stack aligned for calls)
+    emit_bytes(code, {0x53, 0x41, 0x54, 0x41, 0x55});
+    // mov r12, &reg; mov r13, &lazy_flags
+    emit_bytes(code, {0x49, 0xbc});
+    emit64(code, reinterpret_cast<uint64_t>(&reg));
+    emit_bytes(code, {0x49, 0xbd});
+    emit64(code, reinterpret_cast<uint64_t>(&instruction::lazy_flags));
+    // xor ebx, ebx (clocks of this block)
+    emit_bytes(code, {0x31, 0xdb});
+
+    // pc after the current instruction, and whether reg has it
+    dbyte_t pc = block.begin;
+    bool pc_stored = true;
+    for (size_t i = 0; i < block.ops.size(); i++)
+    {
+      const micro_op_t &op = block.ops[i];
+      if (op.len == 0)
+      {
+        // Undefined instruction, leave it to the interpreter
+        return nullptr;
+      }
+
+      pc += op.len;
+      if (i + 1 == block.ops.size() && is_direct_jump(op.opcode))
+      {
+        emit_jump_op(s, op, pc);
+        pc_stored = true;
+        break;
+      }
+      if (emit_inline(s, op))
+      {
+        pc_stored = false;
+        s.pending_clocks += instruction_clocks[op.opcode];
+        continue;
+      }
+
+      spill_regs(s);
+      flush_clocks(s);
+      emit_store_pc(code, pc);
+      pc_stored = true;
+
+      // mov edi, op8; mov esi, op16
+      emit8(code, 0xbf);
+      emit32(code, op.op8);
+      emit8(code, 0xbe);
+      emit32(code, op.op16);
+      // mov rax, handler; call rax
+      emit_bytes(code, {0x48, 0xb8});
+      emit64(code, reinterpret_cast<uint64_t>(op.fast_handler));
+      emit_bytes(code, {0xff, 0xd0});
+      // movsxd rax, eax; add rbx, rax
+      emit_bytes(code, {0x48, 0x63, 0xc0, 0x48, 0x01, 0xc3});
+      // mov rcx, &cpu_clock; add [rcx], rax
+      emit_bytes(code, {0x48, 0xb9});
+      emit64(code, reinterpret_cast<uint64_t>(&cpu_clock));
+      emit_bytes(code, {0x48, 0x01, 0x01});
+      // The handler might have written any flags
+      s.flag_op = -1;
+
+      if (i + 1 == block.ops.size())
+        break;
+
+      // Same checks as the interpreter, each one jumps to exit (jne rel32)
+      // mov rcx, &interrupt_address; cmp byte [rcx], 0
+      emit_bytes(code, {0x48, 0xb9});
+      emit64(code, reinterpret_cast<uint64_t>(&interrupt_address));
+      emit_bytes(code, {0x80, 0x39, 0x00});
+      exits.push_back(emit_jump(code, cond_ne));
+      // mov rcx, &cpu_mode; cmp dword [rcx], 0
+      emit_bytes(code, {0x48, 0xb9});
+      emit64(code, reinterpret_cast<uint64_t>(&cpu_mode));
+      emit_bytes(code, {0x83, 0x39, 0x00});
+      exits.push_back(emit_jump(code, cond_ne));
+      // mov rcx, &block_invalidated; cmp byte [rcx], 0
+      emit_bytes(code, {0x48, 0xb9});
+      emit64(code, reinterpret_cast<uint64_t>(&block_invalidated));
+      emit_bytes(code, {0x80, 0x39, 0x00});
+      exits.push_back(emit_jump(code, cond_ne));
+    }
+
+    // The exits all follow calls, with the registers and clocks stored
+    spill_regs(s);
+    flush_clocks(s);
+    if (!pc_stored)
+    {
+      emit_store_pc(code, pc);
+    }
+
+    // Exit
+    for (size_t pos : exits)
+    {
+      patch_jump(code, pos);
+    }
+    // mov rax, rbx; pop r13; pop r12; pop rbx; ret
+    emit_bytes(code, {0x48, 0x89, 0xd8, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+    return reinterpret_cast<native_block_t>(install_code(code));
+  }
+#else
+  native_block_t compile_block(const block_t &)
+  {
+    return nullptr;
+  }
+#endif
+};
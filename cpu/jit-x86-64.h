@@ -0,0 +1,30 @@
+// Translate hot blocks into x86-64 code, used by the block cache if JIT
+// is defined. Only System V hosts (linux, mac) are supported.
+
+#ifndef JIT_X86_64_H_INCLUDED
+#define JIT_X86_64_H_INCLUDED
+
+#include "block-cache.h"
+
+namespace gameboy
+{
+  // Blocks executed this many times are compiled
+  const int jit_threshold = 16;
+
+  // Compile the block, return nullptr if it cannot be compiled.
+  // cpu_clock is up to date whenever the code calls out, and it returns
+  // early if an interrupt is pending, cpu leaves normal mode or some block is
+  // invalidated. Clocks are not checked, so only run it if the whole block
+  // fits before the clock limit.
+  native_block_t compile_block(const block_t &);
+
+  // Clocks executed by compiled code
+  extern long long jit_clocks;
+
+  // Bumped when the code buffer is full and all code is dropped. Blocks of
+  // unmapped banks and retired blocks still point there, so check it
+  // before running native.
+  extern unsigned jit_generation;
+};
+
+#endif
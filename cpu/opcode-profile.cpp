@@ -0,0 +1,88 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+#include "opcode-profile.h"
+#include "cpu.h"
+
+namespace gameboy
+{
+  // Keyed by the opcodes, 9 bits each
+  std::unordered_map<unsigned, long long> pair_counts, triple_counts;
+
+  // Last two instructions, -1 if control flow broke in between
+  int history[2] = {-1, -1};
+  // Address of the next instruction in sequence
+  int expected_addr = -1;
+
+  void record_opcode(int opcode, dbyte_t addr)
+  {
+    if (addr != expected_addr)
+    {
+      // Jumped or interrupted
+      history[0] = history[1] = -1;
+    }
+    if (history[1] >= 0)
+    {
+      pair_counts[history[1] << 9 | opcode]++;
+      if (history[0] >= 0)
+      {
+        triple_counts[(history[0] << 9 | history[1]) << 9 | opcode]++;
+      }
+    }
+    history[0] = history[1];
+    history[1] = opcode;
+    int len = opcode >= 0x100 ? 2 : instruction_length[opcode];
+    expected_addr = dbyte_t(addr + len);
+  }
+
+  void save_counts(FILE *file,
+    const std::unordered_map<unsigned, long long> &counts, int length)
+  {
+    std::vector<std::pair<long long, unsigned>> sorted;
+    for (const auto &entry : counts)
+    {
+      sorted.push_back({entry.second, entry.first});
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    if (sorted.size() > size_t(profile_top_count))
+    {
+      sorted.resize(profile_top_count);
+    }
+
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      fprintf(file, "    {\"ops\": [");
+      for (int k = length - 1; k >= 0; k--)
+      {
+        int opcode = (sorted[i].second >> (9 * k)) & 0x1ff;
+        fprintf(file, "%d%s", opcode, k ? ", " : "");
+      }
+      fprintf(file, "], \"count\": %lld, \"disas\": \"", sorted[i].first);
+      for (int k = length - 1; k >= 0; k--)
+      {
+        int opcode = (sorted[i].second >> (9 * k)) & 0x1ff;
+        fprintf(file, "%s%s", disas_table[opcode], k ? "; " : "");
+      }
+      fprintf(file, "\"}%s\n", i + 1 < sorted.size() ? "," : "");
+    }
+  }
+
+  void save_opcode_profile(const char *path)
+  {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+      printf("Unable to write opcode profile to %s\n", path);
+      return;
+    }
+    fprintf(file, "{\n  \"pairs\": [\n");
+    save_counts(file, pair_counts, 2);
+    fprintf(file, "  ],\n  \"triples\": [\n");
+    save_counts(file, triple_counts, 3);
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Opcode profile saved to %s\n", path);
+  }
+};
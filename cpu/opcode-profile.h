@@ -0,0 +1,25 @@
+// Count pairs and triples of instructions run one after another, so that
+// gen-instruction-set.py can fuse the frequent ones. Recorded by the switch
+// dispatch if PROFILE_OPCODES is defined.
+
+#ifndef OPCODE_PROFILE_H_INCLUDED
+#define OPCODE_PROFILE_H_INCLUDED
+
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // Written when the emulator stops
+  const char opcode_profile_file[] = "opcode-profile.json";
+
+  // Most frequent sequences saved, of each length
+  const int profile_top_count = 64;
+
+  // Record the instruction at addr. Prefix cb at 0x100-0x1ff.
+  void record_opcode(int opcode, dbyte_t addr);
+
+  // Save the most frequent pairs and triples as json
+  void save_opcode_profile(const char *path);
+};
+
+#endif
@@ -0,0 +1,67 @@
+
+#include <array>
+#include <cstdio>
+#include "static-rom.h"
+#include "cpu.h"
+#include "../main/threads.h"
+#include "../memory/memory.h"
+#include "../memory/cartridge.h"
+
+namespace gameboy
+{
+#ifdef STATIC_ROM
+  // static_blocks keyed by address
+  std::array<static_block_t, 0x8000> static_block_table;
+
+  bool run_static_code(long long clock_limit)
+  {
+    if (static_block_table[static_blocks[0].begin] == nullptr)
+    {
+      for (const static_block_entry_t *e = static_blocks; e->block; e++)
+      {
+        static_block_table[e->begin] = e->block;
+      }
+    }
+
+    bool ran = false;
+    // Code was recompiled with banks 0 and 1 mapped
+    while (reg.pc() < 0x8000 && static_block_table[reg.pc()] != nullptr
+      && page_table[reg.pc() >> 8].read == rom_image + (reg.pc() & 0xff00))
+    {
+      ran = true;
+      if (!static_block_table[reg.pc()](clock_limit))
+        break;
+    }
+    return ran;
+  }
+
+  void run_instructions(long long clock_limit)
+  {
+    static bool warned;
+    bool use_static = rom_hash == static_rom_hash;
+    if (!use_static && !warned)
+    {
+      printf("ROM differs from the recompiled one, interpret it instead.\n");
+      warned = true;
+    }
+
+    byte_t opcode, op8;
+    dbyte_t op16;
+    do
+    {
+      if (use_static && run_static_code(clock_limit))
+        continue;
+      // Same as the loop in cpu.cpp
+      fetch_instruction(&opcode, &op8, &op16);
+      int clocks = exec_instruction(opcode, op8, op16);
+      cpu_clock += clocks;
+      if (clocks < 0)
+      {
+        // Undefined instruction
+        return;
+      }
+    } while (cpu_clock < clock_limit && !interrupt_address
+      && cpu_mode == cpu_mode_normal);
+  }
+#endif
+};
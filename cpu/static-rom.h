@@ -0,0 +1,33 @@
+// Code of one ROM recompiled ahead of time by gen-static-rom.py, used by
+// run_instructions if STATIC_ROM is defined. Code not recompiled (jumps
+// through HL, code in RAM, banks other than 1 at 4000-7fff) and other ROMs
+// are interpreted.
+
+#ifndef STATIC_ROM_H_INCLUDED
+#define STATIC_ROM_H_INCLUDED
+
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // Run a recompiled block, return false if the run loop should stop
+  typedef bool (*static_block_t)(long long clock_limit);
+
+  struct static_block_entry_t
+  {
+    dbyte_t begin;
+    static_block_t block;
+  };
+
+  // Hash of the recompiled ROM, compared with rom_hash
+  extern const unsigned long long static_rom_hash;
+
+  // Generated blocks, terminated by a null block
+  extern const static_block_entry_t static_blocks[];
+
+  // Run recompiled code from pc on, until the run loop would stop or pc
+  // leaves recompiled code. Return false if pc was not recompiled at all.
+  bool run_static_code(long long clock_limit);
+};
+
+#endif
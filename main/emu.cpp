@@ -1,19 +1,29 @@
 
+#include <chrono>
+#include <climits>
 #include <cstdio>
+#include <string>
 #include <vector>
-#include <fstream>
-#include <cstring>
 #include <algorithm>
 #include "threads.h"
+#include "idle-loop.h"
 #include "../util/byte-type.h"
 #include "../memory/memory.h"
+#include "../memory/cartridge.h"
+#include "../memory/battery.h"
+#include "../memory/state-hash.h"
 #include "../cpu/cpu.h"
+#include "../cpu/opcode-profile.h"
 #include "../video/video.h"
 #include "../util/thread-util.h"
+#include "../util/mapped-file.h"
 
 namespace gameboy
 {
+  MappedFile rom_file;
+  // Copy of the ROM if the file is not whole banks
   std::vector<byte_t> rom_buf;
+  unsigned long long rom_hash;
   long long oscillator;
   Condition oscillator_cond;
   long long cpu_clock;
@@ -34,6 +44,12 @@ namespace gameboy
 
   bool init_emulator(const char *rom_dir);
 
+  unsigned long long hash_rom(const byte_t *rom, size_t size);
+
+  // Resident memory of the process in KB, and how much of it are file pages
+  // (the ROM among them). False if not known.
+  bool resident_memory(long &resident_kb, long &file_kb);
+
   void emulator_step();
 
   void video_timing();
@@ -60,42 +76,86 @@ namespace gameboy
     {
       emulator_step();
     }
+    close_battery();
+#ifdef PROFILE_OPCODES
+    save_opcode_profile(opcode_profile_file);
+#endif
     return NULL;
   }
 
   bool init_emulator(const char *rom_dir)
   {
-    // First load the ROM
-    try
+    auto load_begin = std::chrono::steady_clock::now();
+    // First map the ROM, instances of the same game share its pages
+    if (!rom_file.open_read(rom_dir))
     {
-      std::ifstream file(rom_dir, std::ios::binary);
-      std::vector<byte_t> buf(std::istreambuf_iterator<char>(file), {});
-      rom_buf = buf;
+      printf("Error occurred when reading rom %s.\n", rom_dir);
+      return false;
     }
-    catch (const std::exception &e)
+
+    byte_t *rom = rom_file.data();
+    size_t size = rom_image_size(rom_file.size());
+    rom_hash = hash_rom(rom, rom_file.size());
+    if (size != rom_file.size())
     {
-      printf("Error occurred when reading rom: %s", e.what());
-      return false;
+      // Not whole banks, copy and pad
+      rom_buf.assign(rom, rom + rom_file.size());
+      rom_buf.resize(size, 0xff);
+      rom = rom_buf.data();
     }
 
-    if (rom_buf.size() == 0)
+    // Save RAM next to the ROM, game.gb in game.sav
+    std::string save_path(rom_dir);
+    size_t dot = save_path.find_last_of("./");
+    if (dot != std::string::npos && save_path[dot] == '.')
     {
-      printf("Error occurred when reading rom. Size of ROM is 0.\n");
-      return false;
+      save_path.erase(dot);
     }
+    save_path += ".sav";
 
-    if (rom_buf.size() > 0x8000)
+    init_page_table();
+    if (!init_cartridge(rom, size, save_path.c_str()))
     {
-      printf("Memory bank controler is not supported!\n");
       return false;
     }
+    reset_state_hash();
+    load_idle_loops();
 
-    memcpy(memory.begin(), rom_buf.data(), 0x8000 * sizeof(byte_t));
-    // copy_n(rom_buf.cbegin(), 0x4000, memory.begin());
-
+    std::chrono::duration<double, std::milli> load_ms =
+      std::chrono::steady_clock::now() - load_begin;
+    long resident_kb, file_kb;
+    if (resident_memory(resident_kb, file_kb))
+    {
+      printf("ROM loaded in %.2f ms, %ld KB resident (%ld KB shared file "
+        "pages)\n", load_ms.count(), resident_kb, file_kb);
+    }
+    else
+    {
+      printf("ROM loaded in %.2f ms\n", load_ms.count());
+    }
     return true;
   }
 
+  bool resident_memory(long &resident_kb, long &file_kb)
+  {
+    // Linux only
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == NULL)
+      return false;
+    char line[128];
+    int found = 0;
+    while (fgets(line, sizeof line, file))
+    {
+      if (sscanf(line, "VmRSS: %ld", &resident_kb) == 1
+        || sscanf(line, "RssFile: %ld", &file_kb) == 1)
+      {
+        found++;
+      }
+    }
+    fclose(file);
+    return found == 2;
+  }
+
   void emulator_step()
   {
     if (debugger_on)
@@ -111,7 +171,13 @@ namespace gameboy
     cpu_mutex.lock();
     if (cpu_mode != cpu_mode_normal)
     {
-      cpu_clock += 4;
+      // Nothing can wake the cpu before the next event, jump there at once,
+      // in steps of 4 clocks like instructions.
+      // The next event might be LLONG_MAX after 'g', keep the sum in range
+      long long skip = std::min(next_event_clock() - cpu_clock,
+        LLONG_MAX - 3 - cpu_clock);
+      skip = (skip + 3) & ~3ll;
+      cpu_clock += skip > 4 ? skip : 4;
     }
     else if (interrupt_address)
     {
@@ -125,17 +191,26 @@ namespace gameboy
       cpu_clock += 16;
       interrupt_master = false;
       int interrupt_ind = (interrupt_address - 0x40) / 8;
-      memory.at(IF) &= ~(1 << interrupt_ind);
+      mem_at(IF) &= ~(1 << interrupt_ind);
       interrupt_address = 0;
     }
     else
     {
+      // Run until the next video event, or until the oscillator.
+      // While LCD is off video_next_event lies in the past, so instructions
+      // are stepped one by one and start_lcd is noticed in time.
+      long long clock_limit = oscillator;
+      if (video_next_event < clock_limit)
+      {
+        clock_limit = video_next_event;
+      }
       if (debugger_on)
+      {
         printf("%s\n", get_disas().c_str());
-      byte_t opcode, op8;
-      dbyte_t op16;
-      fetch_instruction(&opcode, &op8, &op16);
-      cpu_clock += exec_instruction(opcode, op8, op16);
+        // Step one instruction
+        clock_limit = cpu_clock + 1;
+      }
+      run_instructions(clock_limit);
     }
     cpu_mutex.unlock();
 
@@ -146,16 +221,38 @@ namespace gameboy
       [&]() { return program_ended || cpu_clock < oscillator; });
   }
 
+  unsigned long long hash_rom(const byte_t *rom, size_t size)
+  {
+    // FNV-1a
+    unsigned long long hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+    {
+      hash = (hash ^ rom[i]) * 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  long long next_event_clock()
+  {
+    long long clock = oscillator;
+    if (lcd_on && video_next_event < clock)
+    {
+      clock = video_next_event;
+    }
+    return clock;
+  }
+
   void show_status()
   {
     printf("AF:%.4x BC:%.4x DE:%.4x HL:%.4x PC:%.4x SP:%.4x\n",
       reg.af(), reg.bc(), reg.de(), reg.hl(), reg.pc(), reg.sp(), cpu_clock);
     printf("LCDC:%.2hhx STAT:%.2hhx LY:%.2hhx IE:%.2hhx IF:%.2hhx clock:%lld\n",
-      memory.at(LCDC), memory.at(STAT), memory.at(LY), memory.at(IE), memory.at(IF),
+      mem_at(LCDC), mem_at(STAT), mem_at(LY), mem_at(IE), mem_at(IF),
       cpu_clock);
+    printf("Idle loops skipped %lld clocks\n", idle_skipped_clocks);
     printf("[%.4hx] %.2hhx %.2hhx %.2hhx %.2hhx %.2hhx\n", reg.pc(),
-      memory.at(reg.pc()), memory.at(reg.pc()+1), memory.at(reg.pc()+2),
-      memory.at(reg.pc()+3), memory.at(reg.pc()+4));
+      read_byte(reg.pc()), read_byte(reg.pc()+1), read_byte(reg.pc()+2),
+      read_byte(reg.pc()+3), read_byte(reg.pc()+4));
   }
 
   // Vertical blank is just 10 normal lines
@@ -163,23 +260,26 @@ namespace gameboy
 
   void video_timing()
   {
+    run_dma();
     if (lcd_on && cpu_clock >= video_next_event)
     {
-      byte_t ly = memory.at(LY);
-      byte_t stat = memory.at(STAT) & ~0b111;
+      // LY and STAT change behind the cpu
+      reset_idle_loop();
+      byte_t ly = mem_at(LY);
+      byte_t stat = mem_at(STAT) & ~0b111;
       if (video_mode == h_blank)
       {
         video_mode = sprite_search;
         video_next_event += sprite_search_clocks;
         ly = (ly + 1) % (screen_row_num + v_blank_lines);
-        memory.at(LY) = ly;
+        mem_at(LY) = ly;
         if (debugger_on || ly == 0)
         // printf("========== clk=%lld\n", cpu_clock);
         if (stat & (1 << 3))
         {
           stat_interrupt();
         }
-        byte_t lyc = memory.at(LYC);
+        byte_t lyc = mem_at(LYC);
         if (lyc == ly)
         {
           stat |= 0b100;
@@ -219,7 +319,7 @@ namespace gameboy
         {
           // The first of 10 lines in vertical blank
           // Set vertical blank flag
-          mem_ref(IF) = 1 | memory.at(IF);
+          mem_ref(IF) = 1 | mem_at(IF);
           if (stat & (1 << 4))
           {
             stat_interrupt();
@@ -228,14 +328,14 @@ namespace gameboy
       }
 
       // Set bit 7 to 1
-      memory.at(STAT) = 0x80 | stat;
+      mem_at(STAT) = 0x80 | stat;
     }
   }
 
   byte_t write_interrupt_flag(dbyte_t addr, byte_t val)
   {
-    byte_t events = val & memory.at(IE);
-    // printf("%x %x\n", falling_edge, memory.at(IE));
+    byte_t events = val & mem_at(IE);
+    // printf("%x %x\n", falling_edge, mem_at(IE));
 
     if (events)
     {
@@ -247,7 +347,7 @@ namespace gameboy
           {
             interrupt_address = 0x40 + 8 * i;
             if (debugger_on)
-            printf("Interrupt %d. IF=%.2hhx, IE=%.2hhx\n", i, val, memory.at(IE));
+            printf("Interrupt %d. IF=%.2hhx, IE=%.2hhx\n", i, val, mem_at(IE));
           }
           // Exit halt mode
           cpu_mode = cpu_mode_normal;
@@ -296,7 +396,7 @@ namespace gameboy
 
   void stat_interrupt()
   {
-    byte_t old = memory.at(IF);
+    byte_t old = mem_at(IF);
     mem_ref(IF) = old | (1 << 1);
   }
 
@@ -304,6 +404,6 @@ namespace gameboy
   {
     video_next_event = sprite_search_clocks + cpu_clock;
     video_mode = sprite_search;
-    memory.at(LY) = 0;
+    mem_at(LY) = 0;
   }
 };
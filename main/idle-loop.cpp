@@ -0,0 +1,147 @@
+// A loop is idle if two visits to its head find the same registers, and
+// nothing wrote memory in between. Then every iteration is the same until
+// an event changes memory, so whole iterations are skipped up to there.
+
+#include <cstdio>
+#include <map>
+#include <set>
+#include "idle-loop.h"
+#include "threads.h"
+#include "../cpu/cpu.h"
+#include "../memory/memory.h"
+#include "../memory/cartridge.h"
+
+namespace gameboy
+{
+  long long idle_skipped_clocks;
+
+  // A loop head with its ROM bank in the upper bits. Heads in 4000-7fff
+  // of different banks are different loops.
+  typedef int loop_key_t;
+
+  loop_key_t loop_key(int bank, dbyte_t head)
+  {
+    return bank << 16 | head;
+  }
+
+  // The ROM bank mapped at the head, 0 outside ROM
+  int head_bank(dbyte_t head)
+  {
+    if (head >= 0x8000)
+      return 0;
+    return (page_table[head >> 8].read - rom_image) / rom_bank_size;
+  }
+
+  // Heads of loops confirmed idle
+  std::set<loop_key_t> idle_loops;
+
+  // Times each loop was found idle, until confirmed
+  std::map<loop_key_t, int> idle_candidates;
+
+  // State at the last visit of a loop head
+  struct
+  {
+    bool valid;
+    dbyte_t head;
+    // f is only recorded if the rest matched the visit before
+    bool f_known;
+    byte_t a, f;
+    dbyte_t bc, de, hl, sp;
+    long long clock;
+    unsigned long long writes;
+  } last_visit;
+
+  void load_idle_loops()
+  {
+    FILE *file = fopen(idle_loop_file, "r");
+    if (file == NULL)
+      return;
+    char line[64];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+      unsigned long long hash;
+      unsigned bank, head;
+      if (sscanf(line, "%llx %x %x", &hash, &bank, &head) != 3)
+        continue;
+      if (hash == rom_hash)
+      {
+        idle_loops.insert(loop_key(bank, head));
+      }
+    }
+    fclose(file);
+  }
+
+  void save_idle_loop(int bank, dbyte_t head)
+  {
+    FILE *file = fopen(idle_loop_file, "a");
+    if (file == NULL)
+      return;
+    fprintf(file, "%016llx %x %04x\n", rom_hash, bank, head);
+    fclose(file);
+  }
+
+  void reset_idle_loop()
+  {
+    last_visit.valid = false;
+  }
+
+  void check_idle_loop(dbyte_t from)
+  {
+    dbyte_t head = reg.pc();
+    if (from - head > max_idle_loop_size || debugger_on)
+    {
+      last_visit.valid = false;
+      return;
+    }
+
+    bool same = last_visit.valid && last_visit.head == head
+      && last_visit.writes == memory_writes && last_visit.a == reg.a()
+      && last_visit.bc == reg.bc() && last_visit.de == reg.de()
+      && last_visit.hl == reg.hl() && last_visit.sp == reg.sp();
+    // Reading F packs the lazy flags, only pay for it once the rest
+    // matches. The flags of the visit before are known if it matched too.
+    bool f_known = same;
+    if (same)
+    {
+      byte_t f = reg.f();
+      same = last_visit.f_known && last_visit.f == f;
+      last_visit.f = f;
+    }
+    long long period = cpu_clock - last_visit.clock;
+
+    last_visit.valid = true;
+    last_visit.f_known = f_known;
+    last_visit.head = head;
+    last_visit.a = reg.a();
+    last_visit.bc = reg.bc();
+    last_visit.de = reg.de();
+    last_visit.hl = reg.hl();
+    last_visit.sp = reg.sp();
+    last_visit.clock = cpu_clock;
+    last_visit.writes = memory_writes;
+
+    if (!same || period <= 0 || interrupt_address)
+      return;
+
+    int bank = head_bank(head);
+    loop_key_t key = loop_key(bank, head);
+    if (idle_loops.count(key) == 0)
+    {
+      if (++idle_candidates[key] < idle_confirm_count)
+        return;
+      idle_loops.insert(key);
+      idle_candidates.erase(key);
+      save_idle_loop(bank, head);
+    }
+
+    // The jump itself is not counted in cpu_clock yet, leave one iteration
+    // so the last one still ends before the event
+    long long iterations = (next_event_clock() - cpu_clock) / period - 1;
+    if (iterations > 0)
+    {
+      cpu_clock += iterations * period;
+      idle_skipped_clocks += iterations * period;
+      last_visit.clock = cpu_clock;
+    }
+  }
+};
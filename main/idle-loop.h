@@ -0,0 +1,35 @@
+// Detect loops that poll memory without side effects (e.g. waiting for LY),
+// and skip their iterations until the next event that could end them.
+
+#ifndef IDLE_LOOP_H_INCLUDED
+#define IDLE_LOOP_H_INCLUDED
+
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // Longest loop in bytes, from the jump target to the jump
+  const int max_idle_loop_size = 16;
+
+  // Times a loop is found idle before it is skipped and saved
+  const int idle_confirm_count = 4;
+
+  // Loops confirmed idle, keyed by ROM hash, then ROM bank and address of
+  // the head
+  const char idle_loop_file[] = "idle-loops.txt";
+
+  // Clocks skipped so far
+  extern long long idle_skipped_clocks;
+
+  // Load the confirmed loops of the ROM, after rom_hash is set
+  void load_idle_loops();
+
+  // Called by taken jumps going backward, from the address after the jump.
+  // Might advance cpu_clock.
+  void check_idle_loop(dbyte_t from);
+
+  // Forget the last loop, something outside the cpu changed memory
+  void reset_idle_loop();
+};
+
+#endif
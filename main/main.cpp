@@ -1,13 +1,17 @@
 // Synchronize events, and render video
 
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <limits>
 #include <set>
+#include <vector>
 #include <SDL.h>
 #include "../util/thread-util.h"
 #include "../util/byte-type.h"
 #include "../memory/memory.h"
+#include "../memory/state-hash.h"
+#include "../memory/memory-scan.h"
 #include "../cpu/cpu.h"
 #include "../video/video.h"
 #include "threads.h"
@@ -19,6 +23,11 @@ const char *rom_dir = "testrom.gb";
 
 std::set<dbyte_t> breakpoints;
 
+// Memory search in cartridge RAM and WRAM, see 'k' and 'f'
+const int search_begin = 0xa000, search_end = 0xe000;
+snapshot_t search_snap;
+address_set_t search_candidates;
+
 namespace gameboy
 {
   bool program_ended = false;
@@ -65,6 +74,21 @@ int main(int argc, char *argv[])
   return 0;
 }
 
+// One of == != < > <= >=
+bool parse_scan_op(const char *str, scan_op_t &op)
+{
+  const char *ops[] = {"==", "!=", "<", ">", "<=", ">="};
+  for (int i = 0; i < 6; i++)
+  {
+    if (strcmp(str, ops[i]) == 0)
+    {
+      op = scan_op_t(i);
+      return true;
+    }
+  }
+  return false;
+}
+
 void show_boot_rom();
 void repl()
 {
@@ -73,7 +97,10 @@ void repl()
     "Enter 'd' to toggle debug information. Enter 's' to show status once. "
     "Enter 'r' to run until next breakpoint. Enter 'b' to set new breakpoint."
     "Enter 'n' to delete all breakpoints. Enter 'm' to dump memory. "
-    "Enter 'v' to view video buffer. Enter 'j' to simulate joypad. "
+    "Enter 'h' to show the hash of RAM. Enter 'k' to start a memory search "
+    "and 'f' to narrow it, e.g. 'f > 8' or 'f == 16 1234'. "
+    "Enter 'v' to view video buffer. Enter 'p' to show renderer statistics. "
+    "Enter 'j' to simulate joypad. "
     "Enter 'g' to simply go and play!\n");
   long long step_len = 4;
   char c;
@@ -169,7 +196,7 @@ void repl()
           }
           for (int i = begin; i < end; i++)
           {
-            printf("%.2hhx ", memory.at(i));
+            printf("%.2hhx ", read_byte(i));
             if ((i - begin) % 16 == 15)
             {
               printf("\n");
@@ -180,6 +207,47 @@ void repl()
           break;
         }
 
+        case 'h':
+        printf("State hash %.16llx\n", (unsigned long long)state_hash);
+        break;
+
+        case 'k':
+        take_snapshot(search_snap);
+        search_candidates.words.fill(~0ull);
+        printf("Searching %.4x-%.4x.\n", search_begin, search_end - 1);
+        break;
+
+        case 'f':
+        {
+          // f <op> <8 or 16> [hex value], without a value compare with
+          // memory at the last 'k' or 'f'
+          char line[64], op_str[3];
+          int width;
+          unsigned val;
+          if (fgets(line, sizeof line, stdin) == NULL)
+            break;
+          c = '\n';
+          int n = sscanf(line, "%2s %d %x", op_str, &width, &val);
+          scan_op_t op;
+          if (n < 2 || !parse_scan_op(op_str, op) || (width != 8
+            && width != 16))
+          {
+            printf("Invalid input!\n");
+            break;
+          }
+          search_candidates &= n == 3
+            ? scan_value(search_begin, search_end, width, op, val)
+            : scan_snapshot(search_snap, search_begin, search_end, width, op);
+          take_snapshot(search_snap);
+          std::vector<dbyte_t> addrs = search_candidates.addresses();
+          printf("%d candidates\n", int(addrs.size()));
+          for (size_t i = 0; i < addrs.size() && i < 16; i++)
+          {
+            printf("%.4hx: %.2hhx\n", addrs[i], search_snap.bytes[addrs[i]]);
+          }
+        }
+        break;
+
         case 'v':
         for (int row = 0; row < screen_row_num; row++)
         {
@@ -191,6 +259,10 @@ void repl()
         }
         break;
 
+        case 'p':
+        print_video_stats();
+        break;
+
         case 'j':
         {
           byte_t j;
@@ -248,7 +320,7 @@ void show_boot_rom()
 {
   for (int i = 0; i < 0x60; i++)
   {
-    printf("%.2hhx ", memory.at(i));
+    printf("%.2hhx ", read_byte(i));
   }
   putchar('\n');
 }
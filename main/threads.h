@@ -26,8 +26,8 @@ namespace gameboy
 
   extern byte_t joypad;
 
-  // Joypad
-  byte_t write_joypad(byte_t val);
+  // Joypad, read handler of ff00
+  byte_t read_joypad(dbyte_t addr);
 
 
   // For the emulator thread
@@ -45,9 +45,16 @@ namespace gameboy
   // If cpu_clock >= oscillator, cpu will hang
   extern long long cpu_clock;
 
+  // FNV-1a hash of the loaded ROM
+  extern unsigned long long rom_hash;
+
   // Time of next screen event
   extern long long video_next_event;
 
+  // Earliest clock something outside the cpu might happen: the next screen
+  // event if LCD is on, or the oscillator
+  long long next_event_clock();
+
   extern bool debugger_on;
 
   extern Mutex cpu_mutex;
@@ -60,6 +67,9 @@ namespace gameboy
 
   enum {IF = 0xff0f, IE = 0xffff};
 
+  // Address of pending interrupt, 0 if no interrupt
+  extern byte_t interrupt_address;
+
   void start_lcd();
 
   enum {cpu_mode_normal, cpu_mode_halt, cpu_mode_stop};
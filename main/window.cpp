@@ -194,8 +194,10 @@ namespace gameboy
     // printf("%x\n", joypad);
   }
 
-  byte_t write_joypad(byte_t val)
+  byte_t read_joypad(dbyte_t addr)
   {
+    // The keys are read when the cpu asks, the lines selected last time
+    byte_t val = mem_at(addr);
     byte_t res = ~0;
 
     if (~val & (1 << 4))
@@ -0,0 +1,65 @@
+
+#include <atomic>
+#include <cstdio>
+#include "battery.h"
+#include "../util/byte-type.h"
+#include "../util/mapped-file.h"
+#include "../util/thread-util.h"
+
+namespace gameboy
+{
+  std::atomic<bool> battery_dirty;
+
+  MappedFile battery_file;
+
+  void *battery_main(void *);
+  Thread battery_thread(battery_main);
+  // Signaled by close_battery
+  Condition battery_cond;
+  bool battery_closing;
+
+  void sync_battery()
+  {
+    if (battery_dirty.exchange(false) && !battery_file.sync())
+    {
+      printf("Failed to write the save file.\n");
+    }
+  }
+
+  void *battery_main(void *)
+  {
+    Lock l(battery_cond.mutex);
+    while (!battery_closing)
+    {
+      battery_cond.wait_ms(SAVE_INTERVAL_MS);
+      sync_battery();
+    }
+    return NULL;
+  }
+
+  byte_t *open_battery(const char *path, size_t size)
+  {
+    if (!battery_file.open_write(path, size))
+    {
+      printf("Failed to open save file %s.\n", path);
+      return nullptr;
+    }
+    battery_dirty = false;
+    battery_closing = false;
+    battery_thread.start(NULL);
+    return battery_file.data();
+  }
+
+  void close_battery()
+  {
+    if (battery_file.data() == nullptr)
+      return;
+    battery_cond.mutex.lock();
+    battery_closing = true;
+    battery_cond.signal();
+    battery_cond.mutex.unlock();
+    battery_thread.join();
+    sync_battery();
+    battery_file.close();
+  }
+};
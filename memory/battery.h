@@ -0,0 +1,30 @@
+// Battery-backed cartridge RAM, kept in a .sav file mapped into memory.
+// Writes only set battery_dirty. A thread syncs the file every
+// SAVE_INTERVAL_MS while it is dirty, and at close, so the emulator never
+// waits for the disk.
+
+#ifndef BATTERY_H_INCLUDED
+#define BATTERY_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include "../util/byte-type.h"
+
+#ifndef SAVE_INTERVAL_MS
+#define SAVE_INTERVAL_MS 1000
+#endif
+
+namespace gameboy
+{
+  // Set by writes to battery RAM, cleared when synced
+  extern std::atomic<bool> battery_dirty;
+
+  // Map size bytes of the save file and start syncing it. Return the RAM,
+  // or null if the file cannot be mapped.
+  byte_t *open_battery(const char *path, size_t size);
+
+  // Sync a last time and stop the thread, no effect if not open
+  void close_battery();
+};
+
+#endif
@@ -0,0 +1,325 @@
+
+#include <array>
+#include <cstdio>
+#include <vector>
+#include "cartridge.h"
+#include "memory.h"
+#include "battery.h"
+#include "state-hash.h"
+#include "../util/byte-type.h"
+#include "../cpu/block-cache.h"
+
+namespace gameboy
+{
+  mbc_t mbc;
+  byte_t *rom_image;
+  int rom_bank_num;
+  byte_t *cart_ram;
+  size_t cart_ram_size;
+  // Without a battery
+  std::vector<byte_t> cart_ram_buf;
+  bool has_battery;
+
+  // State of the mapper
+  bool ram_enabled;
+  // For MBC1, rom_bank is the low 5 bits and ram_bank the upper 2 bits
+  // shared by ROM and RAM
+  int rom_bank, ram_bank;
+  bool mbc1_ram_mode;
+
+  // MBC3 clock registers 08-0c, read through rtc_page when selected.
+  // The clock does not run.
+  std::array<byte_t, 5> rtc;
+  std::array<byte_t, 0x100> rtc_page;
+
+  // Read when no RAM is mapped
+  std::array<byte_t, 0x100> open_bus;
+
+  void map_rom(int page_begin, int bank)
+  {
+    byte_t *base = rom_image + bank % rom_bank_num * rom_bank_size;
+    for (int i = 0; i < rom_bank_size / 0x100; i++)
+    {
+      // Never written, writes go to write_cartridge
+      page_table[page_begin + i].read = base + i * 0x100;
+    }
+  }
+
+  void map_ram()
+  {
+    // MBC1 switches RAM banks only in RAM mode
+    int bank = mbc == mbc1 && !mbc1_ram_mode ? 0 : ram_bank;
+    for (int i = 0; i < ram_bank_size / 0x100; i++)
+    {
+      page_t &page = page_table[0xa0 + i];
+      if (ram_enabled && mbc == mbc3 && ram_bank >= 0x08)
+      {
+        page.read = rtc_page.data();
+        page.hash_key = -1;
+        set_page_write(0xa0 + i, nullptr);
+      }
+      else if (ram_enabled && cart_ram_size != 0)
+      {
+        // Small RAM is mirrored
+        size_t offset = (bank * ram_bank_size + i * 0x100) % cart_ram_size;
+        page.read = &cart_ram[offset];
+        page.hash_key = cart_ram_key + offset;
+        // Writes to battery RAM go to write_cartridge, to set battery_dirty
+        set_page_write(0xa0 + i, has_battery ? nullptr : page.read);
+      }
+      else
+      {
+        page.read = open_bus.data();
+        page.hash_key = -1;
+        set_page_write(0xa0 + i, nullptr);
+      }
+    }
+#ifdef BLOCK_CACHE
+    // Code in the old bank is gone
+    for (int addr = 0xa000; addr < 0xc000; addr++)
+    {
+      if (code_bytes[addr])
+      {
+        invalidate_code(addr);
+      }
+    }
+#endif
+  }
+
+  void map_banks()
+  {
+    switch (mbc)
+    {
+      case mbc1:
+      {
+        int bank2 = ram_bank & 3;
+        map_rom(0x00, mbc1_ram_mode ? bank2 << 5 : 0);
+        map_rom(0x40, bank2 << 5 | rom_bank);
+        break;
+      }
+
+      case mbc3:
+      case mbc5:
+      map_rom(0x00, 0);
+      map_rom(0x40, rom_bank);
+      break;
+
+      default:
+      break;
+    }
+  }
+
+  size_t rom_image_size(size_t file_size)
+  {
+    size_t size = 2 * rom_bank_size;
+    while (size < file_size)
+    {
+      size *= 2;
+    }
+    return size;
+  }
+
+  bool init_cartridge(byte_t *rom, size_t size, const char *save_path)
+  {
+    byte_t type = rom[0x147];
+    switch (type)
+    {
+      case 0x03:
+      case 0x0f:
+      case 0x10:
+      case 0x13:
+      case 0x1b:
+      case 0x1e:
+      has_battery = true;
+      break;
+
+      default:
+      has_battery = false;
+      break;
+    }
+
+    switch (type)
+    {
+      case 0x01 ... 0x03:
+      mbc = mbc1;
+      break;
+
+      case 0x0f ... 0x13:
+      mbc = mbc3;
+      break;
+
+      case 0x19 ... 0x1e:
+      mbc = mbc5;
+      break;
+
+      default:
+      // ROM only, or a header we don't know on a ROM that needs no mapper
+      if (type > 0x09 && size > 2 * rom_bank_size)
+      {
+        printf("Memory bank controller %.2hhx is not supported!\n", type);
+        return false;
+      }
+      mbc = mbc_none;
+      break;
+    }
+
+    rom_image = rom;
+    rom_bank_num = size / rom_bank_size;
+
+    for (int i = 0; i < 0x80; i++)
+    {
+      page_table[i].read = rom_image + i * 0x100;
+    }
+    if (mbc == mbc_none)
+    {
+      // a000-bfff stays plain RAM, as for any ROM before
+      return true;
+    }
+
+    const int ram_sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+    byte_t ram_type = rom[0x149];
+    cart_ram_size = ram_type < 6 ? ram_sizes[ram_type] : 0;
+    cart_ram = nullptr;
+    if (has_battery && cart_ram_size != 0)
+    {
+      cart_ram = open_battery(save_path, cart_ram_size);
+    }
+    if (cart_ram == nullptr)
+    {
+      // Lost when the emulator stops
+      has_battery = false;
+      cart_ram_buf.assign(cart_ram_size, 0);
+      cart_ram = cart_ram_buf.data();
+    }
+    open_bus.fill(0xff);
+    for (int i = 0; i < ram_bank_size / 0x100; i++)
+    {
+      page_table[0xa0 + i].tag = page_cart;
+    }
+
+    ram_enabled = false;
+    rom_bank = 1;
+    ram_bank = 0;
+    mbc1_ram_mode = false;
+    map_banks();
+    map_ram();
+    return true;
+  }
+
+  bool write_cartridge(dbyte_t addr, byte_t val)
+  {
+    if (addr >= 0xa000)
+    {
+      if (ram_enabled && mbc == mbc3 && ram_bank >= 0x08)
+      {
+        if (ram_bank <= 0x0c)
+        {
+          rtc[ram_bank - 0x08] = val;
+          rtc_page.fill(val);
+        }
+        return false;
+      }
+      if (!ram_enabled || cart_ram_size == 0)
+      {
+        return false;
+      }
+      if (has_battery)
+      {
+        battery_dirty = true;
+      }
+      return true;
+    }
+
+    switch (mbc)
+    {
+      case mbc1:
+      switch (addr >> 13)
+      {
+        case 0:
+        ram_enabled = (val & 0xf) == 0xa;
+        map_ram();
+        break;
+
+        case 1:
+        rom_bank = val & 0x1f ? val & 0x1f : 1;
+        map_banks();
+        break;
+
+        case 2:
+        ram_bank = val & 3;
+        map_banks();
+        map_ram();
+        break;
+
+        case 3:
+        mbc1_ram_mode = val & 1;
+        map_banks();
+        map_ram();
+        break;
+      }
+      break;
+
+      case mbc3:
+      switch (addr >> 13)
+      {
+        case 0:
+        ram_enabled = (val & 0xf) == 0xa;
+        map_ram();
+        break;
+
+        case 1:
+        rom_bank = val & 0x7f ? val & 0x7f : 1;
+        map_banks();
+        break;
+
+        case 2:
+        ram_bank = val;
+        if (val >= 0x08 && val <= 0x0c)
+        {
+          rtc_page.fill(rtc[val - 0x08]);
+        }
+        map_ram();
+        break;
+
+        default:
+        // Latching the clock, which does not run
+        break;
+      }
+      break;
+
+      case mbc5:
+      switch (addr >> 12)
+      {
+        case 0:
+        case 1:
+        ram_enabled = (val & 0xf) == 0xa;
+        map_ram();
+        break;
+
+        case 2:
+        rom_bank = (rom_bank & 0x100) | val;
+        map_banks();
+        break;
+
+        case 3:
+        rom_bank = (rom_bank & 0xff) | (val & 1) << 8;
+        map_banks();
+        break;
+
+        case 4:
+        case 5:
+        ram_bank = val & 0xf;
+        map_ram();
+        break;
+
+        default:
+        break;
+      }
+      break;
+
+      default:
+      break;
+    }
+    return false;
+  }
+};
@@ -0,0 +1,41 @@
+// Memory bank controllers of the cartridge. Banks are switched by pointing
+// pages of page_table into the ROM image and external RAM, nothing is
+// copied.
+
+#ifndef CARTRIDGE_H_INCLUDED
+#define CARTRIDGE_H_INCLUDED
+
+#include <cstddef>
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  enum mbc_t {mbc_none, mbc1, mbc3, mbc5};
+
+  const int rom_bank_size = 0x4000, ram_bank_size = 0x2000;
+
+  extern mbc_t mbc;
+
+  // The ROM as loaded, a whole number of banks
+  extern byte_t *rom_image;
+  extern int rom_bank_num;
+
+  // External RAM, all banks, in the save file if the cartridge has a battery
+  extern byte_t *cart_ram;
+  extern size_t cart_ram_size;
+
+  // Size of the ROM image for a file of file_size: whole banks, at least
+  // two. Files of other sizes have to be padded.
+  size_t rom_image_size(size_t file_size);
+
+  // Read the header and map banks 0 and 1, after init_page_table. The image
+  // is used in place, size from rom_image_size. Battery RAM is kept in
+  // save_path. Return false if the mapper is not supported.
+  bool init_cartridge(byte_t *rom, size_t size, const char *save_path);
+
+  // Writes to 0000-7fff and a000-bfff which are not plain RAM writes.
+  // Return true if the value should still be stored.
+  bool write_cartridge(dbyte_t addr, byte_t val);
+};
+
+#endif
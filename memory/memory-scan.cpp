@@ -0,0 +1,218 @@
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "memory-scan.h"
+#include "memory.h"
+#include "../util/byte-type.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace gameboy
+{
+  // Memory being scanned, copied so that pages mapped elsewhere are
+  // contiguous. Not reentrant.
+  snapshot_t live;
+
+  // Comparisons of 32 or 16 bytes, or 16 or 8 16-bit lanes, at once. Gt is
+  // unsigned, by flipping the sign bits for the signed compare.
+#if defined(__AVX2__)
+  typedef __m256i vec_t;
+  const int vec_size = 32;
+
+  inline vec_t load(const byte_t *p)
+  {
+    return _mm256_loadu_si256(reinterpret_cast<const vec_t *>(p));
+  }
+  inline vec_t splat8(byte_t val) { return _mm256_set1_epi8(val); }
+  inline vec_t splat16(dbyte_t val) { return _mm256_set1_epi16(val); }
+  inline vec_t eq8(vec_t a, vec_t b) { return _mm256_cmpeq_epi8(a, b); }
+  inline vec_t eq16(vec_t a, vec_t b) { return _mm256_cmpeq_epi16(a, b); }
+  inline vec_t gt8(vec_t a, vec_t b)
+  {
+    vec_t sign = _mm256_set1_epi8(char(0x80));
+    return _mm256_cmpgt_epi8(_mm256_xor_si256(a, sign),
+      _mm256_xor_si256(b, sign));
+  }
+  inline vec_t gt16(vec_t a, vec_t b)
+  {
+    vec_t sign = _mm256_set1_epi16(short(0x8000));
+    return _mm256_cmpgt_epi16(_mm256_xor_si256(a, sign),
+      _mm256_xor_si256(b, sign));
+  }
+  inline std::uint32_t mask(vec_t v) { return _mm256_movemask_epi8(v); }
+#elif defined(__SSE2__)
+  typedef __m128i vec_t;
+  const int vec_size = 16;
+
+  inline vec_t load(const byte_t *p)
+  {
+    return _mm_loadu_si128(reinterpret_cast<const vec_t *>(p));
+  }
+  inline vec_t splat8(byte_t val) { return _mm_set1_epi8(val); }
+  inline vec_t splat16(dbyte_t val) { return _mm_set1_epi16(val); }
+  inline vec_t eq8(vec_t a, vec_t b) { return _mm_cmpeq_epi8(a, b); }
+  inline vec_t eq16(vec_t a, vec_t b) { return _mm_cmpeq_epi16(a, b); }
+  inline vec_t gt8(vec_t a, vec_t b)
+  {
+    vec_t sign = _mm_set1_epi8(char(0x80));
+    return _mm_cmpgt_epi8(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+  }
+  inline vec_t gt16(vec_t a, vec_t b)
+  {
+    vec_t sign = _mm_set1_epi16(short(0x8000));
+    return _mm_cmpgt_epi16(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+  }
+  inline std::uint32_t mask(vec_t v) { return _mm_movemask_epi8(v); }
+#endif
+
+  // Bit i of eq and gt tells how the value at cur + i compares to the one
+  // at old + i, or to val if old is null. 16-bit values also read cur[64].
+  void compare_word(const byte_t *cur, const byte_t *old, dbyte_t val,
+    int width, std::uint64_t &eq, std::uint64_t &gt)
+  {
+    eq = gt = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (int k = 0; k < 64; k += vec_size)
+    {
+      if (width == 8)
+      {
+        vec_t a = load(cur + k);
+        vec_t b = old != nullptr ? load(old + k) : splat8(val);
+        eq |= std::uint64_t(mask(eq8(a, b))) << k;
+        gt |= std::uint64_t(mask(gt8(a, b))) << k;
+      }
+      else
+      {
+        // Lanes start at even addresses, then at odd ones. Both mask bits
+        // of a lane are equal, keep the first.
+        const std::uint64_t even = 0x55555555;
+        for (int odd = 0; odd < 2; odd++)
+        {
+          vec_t a = load(cur + k + odd);
+          vec_t b = old != nullptr ? load(old + k + odd) : splat16(val);
+          eq |= (mask(eq16(a, b)) & even) << (k + odd);
+          gt |= (mask(gt16(a, b)) & even) << (k + odd);
+        }
+      }
+    }
+#else
+    for (int i = 0; i < 64; i++)
+    {
+      int a = cur[i], b = old != nullptr ? old[i] : val & 0xff;
+      if (width == 16)
+      {
+        a |= cur[i + 1] << 8;
+        b = old != nullptr ? b | old[i + 1] << 8 : val;
+      }
+      eq |= std::uint64_t(a == b) << i;
+      gt |= std::uint64_t(a > b) << i;
+    }
+#endif
+  }
+
+  std::uint64_t select(std::uint64_t eq, std::uint64_t gt, scan_op_t op)
+  {
+    switch (op)
+    {
+      case scan_eq:
+      return eq;
+      case scan_ne:
+      return ~eq;
+      case scan_lt:
+      return ~(eq | gt);
+      case scan_gt:
+      return gt;
+      case scan_le:
+      return ~gt;
+      case scan_ge:
+      return eq | gt;
+    }
+    return 0;
+  }
+
+  // Pages as the cpu reads them, the IO page straight from memory
+  void copy_pages(byte_t *dst, int page_begin, int page_end)
+  {
+    for (int i = page_begin; i < page_end; i++)
+    {
+      const byte_t *src = page_table[i].read;
+      memcpy(dst + (i << 8), src != nullptr ? src : &mem_at(i << 8), 0x100);
+    }
+  }
+
+  address_set_t scan(const snapshot_t *old, int begin, int end, int width,
+    scan_op_t op, dbyte_t val)
+  {
+    // The byte after end too, for 16-bit values
+    copy_pages(live.bytes.data(), begin >> 8, std::min(0x100, (end >> 8) + 1));
+    address_set_t set;
+    set.words.fill(0);
+    for (int w = begin >> 6; w < (end + 63) >> 6; w++)
+    {
+      int first = w << 6;
+      std::uint64_t eq, gt;
+      compare_word(&live.bytes[first],
+        old != nullptr ? &old->bytes[first] : nullptr, val, width, eq, gt);
+      std::uint64_t bits = select(eq, gt, op);
+      if (first < begin)
+        bits &= ~0ull << (begin - first);
+      if (first + 64 > end)
+        bits &= ~0ull >> (first + 64 - end);
+      set.words[w] = bits;
+    }
+    return set;
+  }
+
+  int address_set_t::count() const
+  {
+    int n = 0;
+    for (std::uint64_t word : words)
+    {
+      n += __builtin_popcountll(word);
+    }
+    return n;
+  }
+
+  std::vector<dbyte_t> address_set_t::addresses() const
+  {
+    std::vector<dbyte_t> addrs;
+    for (int w = 0; w < int(words.size()); w++)
+    {
+      for (std::uint64_t bits = words[w]; bits != 0; bits &= bits - 1)
+      {
+        addrs.push_back(w << 6 | __builtin_ctzll(bits));
+      }
+    }
+    return addrs;
+  }
+
+  address_set_t &address_set_t::operator &=(const address_set_t &other)
+  {
+    for (size_t w = 0; w < words.size(); w++)
+    {
+      words[w] &= other.words[w];
+    }
+    return *this;
+  }
+
+  void take_snapshot(snapshot_t &snap)
+  {
+    copy_pages(snap.bytes.data(), 0, 0x100);
+    std::fill(snap.bytes.begin() + 0x10000, snap.bytes.end(), 0);
+  }
+
+  address_set_t scan_value(int begin, int end, int width, scan_op_t op,
+    dbyte_t val)
+  {
+    return scan(nullptr, begin, end, width, op, val);
+  }
+
+  address_set_t scan_snapshot(const snapshot_t &snap, int begin, int end,
+    int width, scan_op_t op)
+  {
+    return scan(&snap, begin, end, width, op, 0);
+  }
+};
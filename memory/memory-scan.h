@@ -0,0 +1,58 @@
+// Searching memory for values, e.g. to find where a game keeps a counter:
+// scan for the values that changed, increased or equal X since a snapshot,
+// and intersect the candidates of successive scans. The comparisons use
+// AVX2 or SSE2 when the compiler targets them (see MARCH in the Makefile).
+
+#ifndef MEMORY_SCAN_H_INCLUDED
+#define MEMORY_SCAN_H_INCLUDED
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // How the value at an address compares to the snapshot or to a value.
+  // Comparisons are unsigned.
+  enum scan_op_t {scan_eq, scan_ne, scan_lt, scan_gt, scan_le, scan_ge};
+
+  // Padding after ffff, read by 16-bit scans and vector loads
+  const int scan_padding = 64;
+
+  // The address space as the cpu reads it, without the side effects of IO
+  // reads. External RAM is the bank mapped when taken.
+  struct snapshot_t
+  {
+    std::array<byte_t, 0x10000 + scan_padding> bytes;
+  };
+
+  // A set of addresses, one bit each
+  struct address_set_t
+  {
+    std::array<std::uint64_t, 0x10000 / 64> words;
+
+    bool contains(dbyte_t addr) const
+    {
+      return words[addr >> 6] >> (addr & 63) & 1;
+    }
+    int count() const;
+    std::vector<dbyte_t> addresses() const;
+    // Keep the candidates found again
+    address_set_t &operator &=(const address_set_t &other);
+  };
+
+  void take_snapshot(snapshot_t &snap);
+
+  // Addresses in [begin, end) whose value compares to val. width is 8 or
+  // 16, a 16-bit value is little endian at addr and addr + 1.
+  address_set_t scan_value(int begin, int end, int width, scan_op_t op,
+    dbyte_t val);
+
+  // Addresses in [begin, end) whose value now compares to the one in snap,
+  // e.g. scan_gt for the ones that increased
+  address_set_t scan_snapshot(const snapshot_t &snap, int begin, int end,
+    int width, scan_op_t op);
+};
+
+#endif
@@ -1,7 +1,10 @@
 
 #include <array>
+#include <cstring>
 #include "memory.h"
+#include "cartridge.h"
 #include "../util/byte-type.h"
+#include "../util/bit-register.h"
 #include "../video/video.h"
 #include "../main/threads.h"
 #include "../cpu/cpu.h"
@@ -9,62 +12,243 @@
 namespace gameboy
 {
   std::array<byte_t, 0x10000> memory;
+  unsigned long long memory_writes;
 
-  MemoryReference mem_ref(dbyte_t addr)
+  // Echo RAM E000-FDFF mirrors C000-DDFF
+  const int echo_begin = 0xe0, echo_end = 0xfe, echo_offset = 0x20;
+
+  std::array<page_t, 0x100> default_page_table()
+  {
+    std::array<page_t, 0x100> table;
+    for (int i = 0; i < 0x100; i++)
+    {
+      page_t &page = table[i];
+      int base = i >= echo_begin && i < echo_end ? i - echo_offset : i;
+      page.read = &mem_at(base << 8);
+      page.write = page.read;
+      page.hash_key = -1;
+      if (i < 0x80)
+      {
+        page.tag = page_rom;
+        page.write = nullptr;
+      }
+      else if (i < 0xa0)
+      {
+        page.tag = page_video;
+        page.write = nullptr;
+      }
+      else if (i == 0xfe)
+      {
+        // OAM
+        page.tag = page_video;
+        page.write = nullptr;
+      }
+      else if (i == 0xff)
+      {
+        // IO, HRAM and IE, see io_table
+        page.tag = page_io;
+        page.read = nullptr;
+        page.write = nullptr;
+        page.hash_key = i << 8;
+      }
+      else
+      {
+        // External RAM is hashed by the cartridge if it has a mapper
+        page.tag = page_ram;
+        page.hash_key = base << 8;
+      }
+    }
+    for (page_t &page : table)
+    {
+      page.unwatched_write = page.write;
+    }
+    return table;
+  }
+
+  std::array<page_t, 0x100> page_table = default_page_table();
+
+  std::array<bool, 0x100> dirty_pages;
+  std::array<byte_t, 0x100> page_watch_mask;
+  std::array<watch_t, max_watches> watches;
+  int watch_num;
+
+  std::array<io_register_t, 0x100> default_io_table()
+  {
+    std::array<io_register_t, 0x100> table;
+    for (io_register_t &io : table)
+    {
+      io = {nullptr, nullptr, 0xff};
+    }
+    table[0x00] = {nullptr, read_joypad, 0x30};
+    table[IF & 0xff] = {write_interrupt_flag, nullptr, 0xff};
+    for (int addr = LCDC; addr <= WX; addr++)
+    {
+      table[addr & 0xff] = {write_video_mem, nullptr, 0xff};
+    }
+    // Mode and coincidence flags are set by the video timing
+    table[STAT & 0xff].writable = 0x78;
+    table[LY & 0xff] = {nullptr, nullptr, 0x00};
+    return table;
+  }
+
+  std::array<io_register_t, 0x100> io_table = default_io_table();
+
+  void init_page_table()
+  {
+    page_table = default_page_table();
+    page_watch_mask.fill(0);
+  }
+
+  void set_page_write(byte_t page, byte_t *write)
+  {
+    page_table[page].unwatched_write = write;
+    page_table[page].write = page_watch_mask[page] ? nullptr : write;
+  }
+
+  int echo_mirror(dbyte_t addr)
+  {
+    int page = addr >> 8;
+    if (page >= echo_begin && page < echo_end)
+      return addr - (echo_offset << 8);
+    if (page >= echo_begin - echo_offset && page < echo_end - echo_offset)
+      return addr + (echo_offset << 8);
+    return -1;
+  }
+
+  std::bitset<0x100> take_dirty_pages()
   {
-    return MemoryReference(addr);
+    std::bitset<0x100> pages;
+    for (int i = 0; i < 0x100; i++)
+    {
+      pages[i] = dirty_pages[i];
+    }
+    dirty_pages.fill(false);
+    return pages;
+  }
+
+  int add_watch(watch_t callback)
+  {
+    if (watch_num == max_watches)
+      return -1;
+    watches[watch_num] = callback;
+    return watch_num++;
   }
 
-  byte_t MemoryReference::read() const
+  void watch_page(int watch, byte_t page)
   {
-    return memory.at(addr);
+    page_watch_mask[page] |= 1 << watch;
+    page_table[page].write = nullptr;
+  }
+
+  void unwatch_page(int watch, byte_t page)
+  {
+    page_watch_mask[page] &= ~(1 << watch);
+    if (page_watch_mask[page] == 0)
+    {
+      page_table[page].write = page_table[page].unwatched_write;
+    }
   }
 
-  void MemoryReference::write(byte_t val)
+  byte_t read_slow(dbyte_t addr)
+  {
+    // Only the IO page is read here for now
+    const io_register_t &io = io_table[addr & 0xff];
+    if (io.read != nullptr)
+    {
+      return io.read(addr);
+    }
+    return mem_at(addr);
+  }
+
+  // Where the slow path stores a byte: what the page reads, else memory.
+  // OAM reads ff during a timed DMA, but is stored in memory too.
+  byte_t *write_dst(dbyte_t addr)
+  {
+    const page_t &page = page_table[addr >> 8];
+    if (page.read == nullptr || page.tag == page_video)
+      return &mem_at(addr);
+    return &page.read[addr & 0xff];
+  }
+
+  // Store a byte, with the bookkeeping of all writes
+  void store(dbyte_t addr, byte_t *dst, byte_t old_val, byte_t val)
+  {
+    const page_t &page = page_table[addr >> 8];
+    if (page.hash_key >= 0 && (page.tag != page_io || (addr >= hram_begin
+      && addr != IE)))
+    {
+      hash_store(page.hash_key + (addr & 0xff), old_val, val);
+    }
+    *dst = val;
+    dirty_pages[addr >> 8] = true;
+    for (byte_t mask = page_watch_mask[addr >> 8]; mask != 0; mask &= mask - 1)
+    {
+      watches[__builtin_ctz(mask)](addr, old_val, val);
+    }
+  }
+
+  void write_slow(dbyte_t addr, byte_t val)
   {
     // if (addr == 0xff00)
     // {
     //   printf("----------------------------------%.4hx %.2hhx %lld\n", reg.pc(), val, oscillator);
     // }
-    if (addr < 0x8000)
-    {
-      // ROM
-      return; // Some more could happen later on
-    }
-    else
+    const page_t &page = page_table[addr >> 8];
+    byte_t *dst = write_dst(addr);
+    byte_t old_val = *dst;
+    switch (page.tag)
     {
-      // Case with ranges, gnu c extension
-      switch (addr)
+      case page_rom:
+      case page_cart:
+      // Bank switching, or external RAM that is disabled, battery-backed
+      // or watched
+      if (!write_cartridge(addr, val))
       {
-        case 0x8000 ... 0x9fff:
-        case 0xfe00 ... 0xfe9f:
-        case 0xff40 ... 0xff4b:
-        val = write_video_mem(addr, val);
-        break;
-
-        case 0xff0f:
-        val = write_interrupt_flag(addr, val);
-        break;
+        return;
+      }
+      break;
 
-        case 0xff00:
-        val = write_joypad(val);
+      case page_video:
+      val = write_video_mem(addr, val);
+      break;
 
-        default:
+      case page_io:
+      {
+        const io_register_t &io = io_table[addr & 0xff];
+        if (io.write != nullptr)
+        {
+          val = io.write(addr, val);
+        }
+        val = write_controled(old_val, val, io.writable);
         break;
       }
-      memory.at(addr) = val;
+
+      default:
+      break;
     }
+    store(addr, dst, old_val, val);
   }
 
-  MemoryReference::operator byte_t() const
+  void write_by_hardware(dbyte_t addr, byte_t val)
   {
-    return read();
+    byte_t *dst = write_dst(addr);
+    store(addr, dst, *dst, val);
   }
 
-  MemoryReference &MemoryReference::operator =(byte_t val)
+  void copy_by_hardware(dbyte_t addr, const byte_t *src, int len)
   {
-    write(val);
-    return *this;
+    byte_t *dst = write_dst(addr);
+    if (page_table[addr >> 8].hash_key < 0 && page_watch_mask[addr >> 8] == 0)
+    {
+      // The source might be the page itself
+      memmove(dst, src, len);
+      dirty_pages[addr >> 8] = true;
+      return;
+    }
+    for (int i = 0; i < len; i++)
+    {
+      store(addr + i, dst + i, dst[i], src[i]);
+    }
   }
 
   void write_dbyte(dbyte_t addr, dbyte_t val)
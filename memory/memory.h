@@ -3,14 +3,128 @@
 #define MEMORY_H_INCLUDED
 
 #include <array>
+#include <bitset>
 #include "../util/byte-type.h"
+#include "state-hash.h"
 
 namespace gameboy
 {
   // The whole memory is stored contiguously
-  // Other module should directly access this
+  // Other module should directly access this, through mem_at
   extern std::array<byte_t, 0x10000> memory;
 
+  // A byte of memory, without side effects. Bounds are checked only if
+  // CHECKED_MEMORY is defined (Makefile MODE=debug), e.g. to catch pc + 1
+  // running past ffff.
+  inline byte_t &mem_at(int addr)
+  {
+#ifdef CHECKED_MEMORY
+    return memory.at(addr);
+#else
+    return memory[addr];
+#endif
+  }
+
+  // Number of writes through MemoryReference, ROM included
+  extern unsigned long long memory_writes;
+
+  // What a page holds, decides the slow path of writes
+  enum page_tag_t {page_ram, page_rom, page_cart, page_video, page_io};
+
+  // One page of 256 bytes. A null pointer sends the access to the slow
+  // path, e.g. writes to ROM, VRAM, OAM, IO and watched pages, and reads of
+  // IO.
+  struct page_t
+  {
+    byte_t *read;
+    byte_t *write;
+    // Write pointer while no watch is set, see set_page_write
+    byte_t *unwatched_write;
+    page_tag_t tag;
+    // Key of byte 00 in the state hash, -1 if the page is not hashed. Of
+    // the IO page only HRAM is.
+    int hash_key;
+  };
+
+  extern std::array<page_t, 0x100> page_table;
+
+  // Map the pages of memory again, echo RAM mirrors WRAM. Watches are
+  // cleared.
+  void init_page_table();
+
+  // Change where plain writes to the page go, null for the slow path
+  void set_page_write(byte_t page, byte_t *write);
+
+  // The other address of a byte in echo RAM or the WRAM it mirrors, or -1
+  int echo_mirror(dbyte_t addr);
+
+  // Pages written since the last take_dirty_pages, as addressed (a write
+  // to echo RAM marks the echo page). Writes that store nothing, e.g. bank
+  // switches, and writes by other modules directly to memory are not seen.
+  extern std::array<bool, 0x100> dirty_pages;
+
+  // Return the dirty pages and clear them
+  std::bitset<0x100> take_dirty_pages();
+
+  // Called after a byte of a watched page is written, with the old value
+  typedef void (*watch_t)(dbyte_t addr, byte_t old_val, byte_t new_val);
+
+  const int max_watches = 8;
+
+  // Bit i set if watch i wants the writes to the page. Writes to watched
+  // pages take the slow path, others don't pay for watches at all.
+  extern std::array<byte_t, 0x100> page_watch_mask;
+
+  // Return the number of the new watch, -1 if there are too many
+  int add_watch(watch_t callback);
+
+  // Start or stop sending writes to the page to a watch
+  void watch_page(int watch, byte_t page);
+  void unwatch_page(int watch, byte_t page);
+
+  byte_t read_slow(dbyte_t addr);
+  void write_slow(dbyte_t addr, byte_t val);
+
+  // Store a byte written by the hardware, e.g. DMA, not the cpu. The page
+  // has no side effects, but the state hash, dirty pages and watches see
+  // the write.
+  void write_by_hardware(dbyte_t addr, byte_t val);
+
+  // Same for len bytes from src, within one page. Without a hash or a
+  // watch on the page, it is one copy.
+  void copy_by_hardware(dbyte_t addr, const byte_t *src, int len);
+
+  // Side effect of writing an IO register, returns the value to store
+  typedef byte_t (*io_write_t)(dbyte_t addr, byte_t val);
+  // Value of an IO register computed when read
+  typedef byte_t (*io_read_t)(dbyte_t addr);
+
+  // Descriptor of a register in ff00-ffff. Null handlers mean a plain
+  // store or load, bits outside writable keep their value on cpu writes.
+  struct io_register_t
+  {
+    io_write_t write;
+    io_read_t read;
+    byte_t writable;
+  };
+
+  extern std::array<io_register_t, 0x100> io_table;
+
+  // HRAM shares its page with IO, but needs no descriptor. Reads up to IE
+  // and writes below it are plain, so they skip the slow path.
+  const int hram_begin = 0xff80;
+
+  // Read a byte without side effects, as the cpu sees it
+  inline byte_t read_byte(dbyte_t addr)
+  {
+    const page_t &page = page_table[addr >> 8];
+    if (page.read != nullptr)
+      return page.read[addr & 0xff];
+    if (addr >= hram_begin)
+      return mem_at(addr);
+    return read_slow(addr);
+  }
+
   // Memory Reference wrapper, basically for use in CPU
   class MemoryReference
   {
@@ -23,20 +137,57 @@ namespace gameboy
 
     // Complicated memory write
     // Might involve write control, signal events, etc.
-    void write(byte_t val);
+    void write(byte_t val)
+    {
+      memory_writes++;
+      const page_t &page = page_table[addr >> 8];
+      // write_slow marks the page dirty itself, if it stores the byte
+      if (page.write != nullptr)
+      {
+        byte_t &dst = page.write[addr & 0xff];
+        if (page.hash_key >= 0)
+          hash_store(page.hash_key + (addr & 0xff), dst, val);
+        dst = val;
+        dirty_pages[addr >> 8] = true;
+      }
+      else if (addr >= hram_begin && addr != 0xffff
+        && page_watch_mask[addr >> 8] == 0)
+      {
+        // HRAM, IE is not hashed
+        byte_t &dst = mem_at(addr);
+        hash_store(page.hash_key + (addr & 0xff), dst, val);
+        dst = val;
+        dirty_pages[addr >> 8] = true;
+      }
+      else
+        write_slow(addr, val);
+    }
 
     // Read from memory
-    byte_t read() const;
+    byte_t read() const
+    {
+      return read_byte(addr);
+    }
 
     // Calls read()
-    operator byte_t() const;
+    operator byte_t() const
+    {
+      return read();
+    }
 
     // Calls write()
-    MemoryReference &operator =(byte_t val);
+    MemoryReference &operator =(byte_t val)
+    {
+      write(val);
+      return *this;
+    }
   };
 
   // convenience function
-  MemoryReference mem_ref(dbyte_t);
+  inline MemoryReference mem_ref(dbyte_t addr)
+  {
+    return MemoryReference(addr);
+  }
 
   // Write a two-byte value
   void write_dbyte(dbyte_t addr, dbyte_t val);
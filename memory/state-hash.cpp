@@ -0,0 +1,41 @@
+
+#include <cstdint>
+#include "state-hash.h"
+#include "memory.h"
+#include "cartridge.h"
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  std::uint64_t state_hash;
+
+  std::uint64_t full_state_hash()
+  {
+    std::uint64_t hash = 0;
+    for (int addr = 0xc000; addr < 0xe000; addr++)
+    {
+      hash ^= hash_byte(addr, mem_at(addr));
+    }
+    for (int addr = 0xff80; addr < 0xffff; addr++)
+    {
+      hash ^= hash_byte(addr, mem_at(addr));
+    }
+    if (mbc == mbc_none)
+    {
+      for (int addr = 0xa000; addr < 0xc000; addr++)
+      {
+        hash ^= hash_byte(addr, mem_at(addr));
+      }
+    }
+    for (size_t i = 0; i < cart_ram_size; i++)
+    {
+      hash ^= hash_byte(cart_ram_key + i, cart_ram[i]);
+    }
+    return hash;
+  }
+
+  void reset_state_hash()
+  {
+    state_hash = full_state_hash();
+  }
+};
@@ -0,0 +1,44 @@
+// Hash of the RAM a game keeps its state in: WRAM, HRAM and cartridge RAM.
+// Each byte contributes hash_byte(key, value) and the results are XORed, so
+// a store updates the hash in O(1) (Zobrist hashing, with the table of
+// random numbers replaced by a mixing function).
+
+#ifndef STATE_HASH_H_INCLUDED
+#define STATE_HASH_H_INCLUDED
+
+#include <cstdint>
+#include "../util/byte-type.h"
+
+namespace gameboy
+{
+  // Keys of the bytes: the address for WRAM c000-dfff, HRAM ff80-fffe and
+  // a000-bfff of cartridges without a mapper, cart_ram_key plus the offset
+  // for external RAM, whatever bank is mapped
+  const int cart_ram_key = 0x10000;
+
+  // Kept up to date by the write path, see page_t::hash_key
+  extern std::uint64_t state_hash;
+
+  inline std::uint64_t hash_byte(int key, byte_t val)
+  {
+    // Finalizer of splitmix64
+    std::uint64_t x = (std::uint64_t(key) << 8 | val) + 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+
+  inline void hash_store(int key, byte_t old_val, byte_t new_val)
+  {
+    state_hash ^= hash_byte(key, old_val) ^ hash_byte(key, new_val);
+  }
+
+  // Hash all the bytes again, equal to state_hash unless something wrote
+  // memory directly
+  std::uint64_t full_state_hash();
+
+  // Start from full_state_hash, once the cartridge is mapped
+  void reset_state_hash();
+};
+
+#endif
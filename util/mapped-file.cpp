@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <vector>
+#include "mapped-file.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace gameboy
+{
+  MappedFile::MappedFile()
+  {
+    ptr = nullptr;
+    len = 0;
+  }
+
+  MappedFile::~MappedFile()
+  {
+    close();
+  }
+
+#ifndef _WIN32
+  bool MappedFile::open_read(const char *path)
+  {
+    close();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    ptr = static_cast<byte_t *>(p);
+    len = st.st_size;
+    return true;
+  }
+
+  bool MappedFile::open_write(const char *path, size_t size)
+  {
+    close();
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    // New bytes read as 0
+    if (fstat(fd, &st) != 0
+      || (size_t(st.st_size) < size && ftruncate(fd, size) != 0))
+    {
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    ptr = static_cast<byte_t *>(p);
+    len = size;
+    return true;
+  }
+
+  bool MappedFile::sync()
+  {
+    return ptr != nullptr && msync(ptr, len, MS_SYNC) == 0;
+  }
+
+  void MappedFile::close()
+  {
+    if (ptr != nullptr && buf.empty())
+    {
+      munmap(ptr, len);
+    }
+    ptr = nullptr;
+    len = 0;
+    buf.clear();
+  }
+#else
+  bool MappedFile::open_read(const char *path)
+  {
+    close();
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+      return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size > 0)
+    {
+      buf.resize(size);
+      if (fread(buf.data(), 1, size, file) != size_t(size))
+        buf.clear();
+    }
+    fclose(file);
+    if (buf.empty())
+      return false;
+    ptr = buf.data();
+    len = buf.size();
+    return true;
+  }
+
+  bool MappedFile::open_write(const char *path, size_t size)
+  {
+    close();
+    buf.assign(size, 0);
+    FILE *file = fopen(path, "rb");
+    if (file != NULL)
+    {
+      // A short file leaves zeros
+      fread(buf.data(), 1, size, file);
+      fclose(file);
+    }
+    buf_path = path;
+    ptr = buf.data();
+    len = size;
+    return true;
+  }
+
+  bool MappedFile::sync()
+  {
+    // The whole file, without a mapping
+    FILE *file = fopen(buf_path.c_str(), "wb");
+    if (file == NULL)
+      return false;
+    bool ok = fwrite(buf.data(), 1, len, file) == len;
+    return fclose(file) == 0 && ok;
+  }
+
+  void MappedFile::close()
+  {
+    ptr = nullptr;
+    len = 0;
+    buf.clear();
+    buf_path.clear();
+  }
+#endif
+};
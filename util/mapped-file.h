@@ -0,0 +1,40 @@
+// Files mapped into memory, so processes opening the same file share its
+// pages. Where mmap is missing (_WIN32), the file is read into a buffer.
+#ifndef MAPPED_FILE_H_INCLUDED
+#define MAPPED_FILE_H_INCLUDED
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "byte-type.h"
+
+namespace gameboy
+{
+  class MappedFile
+  {
+  public:
+    MappedFile();
+    // Will call close
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    // Map the whole file read only. Pages are private, but shared with
+    // other processes until written. Return false on failure.
+    bool open_read(const char *path);
+    // Map size bytes of the file for writing, creating or extending it.
+    // Writes reach the file, at the latest when synced.
+    bool open_write(const char *path, size_t size);
+    // Write changes to the file, blocks until done
+    bool sync();
+    // Unmap
+    void close();
+    byte_t *data() { return ptr; }
+    size_t size() const { return len; }
+  private:
+    byte_t *ptr;
+    size_t len;
+    // Holds the file if it is not mapped
+    std::vector<byte_t> buf;
+    // Where sync writes buf
+    std::string buf_path;
+  };
+};
+#endif
@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <cassert>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../../util/byte-type.h"
+#include "../../cpu/alu-table.h"
+
+using namespace gameboy;
+
+// DAA computed with branches, the way cpu.cpp used to do it
+dbyte_t daa(byte_t val, byte_t f)
+{
+  bool carry = f & 0x10;
+  if (f & 0x40)
+  {
+    if (f & 0x20)
+      val -= 6;
+    if (carry)
+      val -= 0x60;
+  }
+  else
+  {
+    if ((val & 0xf) > 9 || f & 0x20)
+      val += 6;
+    carry = (val & 0xf0) > 0x90 || carry;
+    if (carry)
+      val += 0x60;
+  }
+  return val << 8 | (val == 0) << 7 | (f & 0x40) | carry << 4;
+}
+
+// Random inputs, so branches are hard to predict like in real code
+std::vector<int> inputs;
+
+template <typename F>
+double measure(const char *name, F f)
+{
+  auto begin = std::chrono::steady_clock::now();
+  unsigned sum = 0;
+  for (int round = 0; round < 16; round++)
+  {
+    for (int i : inputs)
+    {
+      sum += f(i);
+    }
+  }
+  std::chrono::duration<double, std::milli> ms =
+    std::chrono::steady_clock::now() - begin;
+  printf("%-12s %8.2f ms (%x)\n", name, ms.count(), sum);
+  return ms.count();
+}
+
+// Not inlined, so the loop is not vectorized as no interpreter loop would be
+__attribute__((noinline)) dbyte_t daa_branch(int i)
+{
+  return daa(i, i >> 4 & 0x70);
+}
+
+__attribute__((noinline)) dbyte_t daa_table(int i)
+{
+  return alu_table.daa[i >> 8 & 7][i & 0xff];
+}
+
+int main()
+{
+  for (int nhc = 0; nhc < 8; nhc++)
+  {
+    for (int val = 0; val < 256; val++)
+    {
+      assert(alu_table.daa[nhc][val] == daa(val, nhc << 4));
+    }
+  }
+  for (int val = 0; val < 256; val++)
+  {
+    byte_t rl = val << 1 | val >> 7;
+    assert(alu_table.rotate[rot_rlc][0][val] >> 8 == rl);
+    assert((alu_table.rotate[rot_rl][1][val] >> 8) == byte_t(val << 1 | 1));
+    assert((alu_table.rotate[rot_sra][0][val] >> 8)
+      == byte_t(int8_t(val) >> 1));
+    assert(bool(alu_table.rotate[rot_rr][0][val] & 0x10) == bool(val & 1));
+  }
+  puts("tables match");
+
+  // Operands of real programs are mostly small numbers
+  std::mt19937 gen(1);
+  std::geometric_distribution<int> operand(0.05);
+  for (int i = 0; i < (1 << 20); i++)
+  {
+    inputs.push_back((operand(gen) & 0xff) | (gen() & 1) << 8
+      | (operand(gen) & 0xff) << 9);
+  }
+  measure("daa branch", daa_branch);
+  measure("daa table", daa_table);
+}
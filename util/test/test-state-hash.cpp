@@ -0,0 +1,63 @@
+
+#include <cstdio>
+#include <cassert>
+#include <random>
+#include <vector>
+#include "../../memory/memory.h"
+#include "../../memory/cartridge.h"
+#include "../../memory/state-hash.h"
+#include "../../util/byte-type.h"
+
+using namespace gameboy;
+
+// IO registers are not written here
+namespace gameboy
+{
+  byte_t write_video_mem(dbyte_t, byte_t val) { return val; }
+  byte_t write_interrupt_flag(dbyte_t, byte_t val) { return val; }
+  byte_t read_joypad(dbyte_t) { return 0xff; }
+};
+
+// Random writes to hashed and other RAM, then compare with a full rehash
+void test(byte_t cart_type, std::mt19937 &rng)
+{
+  std::vector<byte_t> rom(4 * rom_bank_size, 0);
+  rom[0x147] = cart_type;
+  // 32KB of RAM, 4 banks
+  rom[0x149] = 3;
+  init_page_table();
+  bool ok = init_cartridge(rom.data(), rom.size(), "test-state-hash.sav");
+  assert(ok);
+  reset_state_hash();
+  assert(state_hash == full_state_hash());
+
+  std::uint64_t start = state_hash;
+  const dbyte_t ranges[][2] = {
+    {0xa000, 0xc000}, {0xc000, 0xfe00}, {0xff80, 0xffff}};
+  for (int i = 0; i < 100000; i++)
+  {
+    const dbyte_t *range = ranges[rng() % 3];
+    dbyte_t addr = range[0] + rng() % (range[1] - range[0]);
+    if (rng() % 64 == 0)
+    {
+      // Enable RAM, switch banks
+      addr = rng() % 0x8000;
+    }
+    mem_ref(addr) = byte_t(rng());
+  }
+  assert(state_hash == full_state_hash());
+  assert(state_hash != start);
+  printf("Cartridge %.2hhx: %.16llx\n", cart_type,
+    (unsigned long long)state_hash);
+}
+
+int main()
+{
+  std::mt19937 rng(1);
+  // ROM only, MBC1+RAM, MBC3+RAM, MBC5+RAM
+  test(0x00, rng);
+  test(0x02, rng);
+  test(0x12, rng);
+  test(0x1a, rng);
+  printf("State hash matches a full rehash.\n");
+}
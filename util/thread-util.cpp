@@ -1,3 +1,4 @@
+#include <ctime>
 #include <functional>
 #include "thread-util.h"
 namespace gameboy
@@ -87,6 +88,20 @@ namespace gameboy
     return pthread_cond_wait(cnd, mutex.mtx);
   }
 
+  bool Condition::wait_ms(long ms)
+  {
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += ms % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(cnd, mutex.mtx, &deadline) == 0;
+  }
+
   void Condition::wait_for(std::function<bool()> pred)
   {
     Lock l(mutex);
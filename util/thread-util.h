@@ -55,6 +55,9 @@ namespace gameboy
     // pthread_cond_wait
     // Remember to lock this method as critical section.
     int wait();
+    // pthread_cond_timedwait, false if ms milliseconds passed
+    // Remember to lock this method as critical section.
+    bool wait_ms(long ms);
     // Wait for the the expression to be true
     // Automatically locks and unlocks mutex
     void wait_for(std::function<bool()>);
@@ -1,11 +1,14 @@
 
 #include <array>
 #include <cstring>
-#include <vector>
 #include <algorithm>
 #include <cstdio>
+#include <cstdint>
 #include "video.h"
 #include "../main/threads.h"
+#ifdef __SSSE3__
+#include <immintrin.h>
+#endif
 
 namespace gameboy
 {
@@ -20,6 +23,22 @@ namespace gameboy
   };
   std::array<sprite_t, 40> sprite_set;
 
+  // Only the first 10 sprites in OAM covering a line are drawn
+  const int max_line_sprites = 10;
+
+  // Bit i set if sprite i covers the line, kept up to date as sprites move
+  std::array<uint64_t, screen_row_num> line_sprite_mask;
+
+  // The sprites drawn on a line, ordered by x then by index so the
+  // priority decreases. Rebuilt from line_sprite_mask when dirty.
+  struct line_sprites_t
+  {
+    bool dirty;
+    int num;
+    std::array<byte_t, max_line_sprites> index;
+  };
+  std::array<line_sprites_t, screen_row_num> line_sprites;
+
   // ff40: LCDC
   bool bg_on;
   bool sprite_on;
@@ -30,6 +49,52 @@ namespace gameboy
   dbyte_t win_map_addr;
   bool lcd_on;
 
+  // The two tile maps, 9800 and 9c00, decoded to 256x256 color indices.
+  // A cell (8x8 pixels, one map entry) is decoded again when its entry is
+  // written, its tile data changed, or the tile numbering changed.
+  typedef std::array<std::array<color_t, 256>, 256> plane_t;
+  std::array<plane_t, 2> map_planes;
+
+  // Which tile a cell was decoded from, and its tile_version then
+  struct map_cell_t
+  {
+    dbyte_t tile_num;
+    uint32_t version;
+  };
+  std::array<std::array<map_cell_t, 32 * 32>, 2> map_cells;
+
+  // map_planes through BGP, for lines drawn without transparency. Per cell
+  // and per row of cells, the palette byte plus one it was resolved with,
+  // 0 if none or the cell was decoded since.
+  std::array<plane_t, 2> color_planes;
+  std::array<std::array<dbyte_t, 32 * 32>, 2> cell_palette;
+  std::array<std::array<dbyte_t, 32>, 2> row_palette;
+
+  // Per map and row of 32 cells, bit i set if cell i was written
+  typedef std::array<std::array<uint32_t, 32>, 2> map_dirty_t;
+
+  map_dirty_t all_maps_dirty()
+  {
+    map_dirty_t dirty;
+    for (auto &map : dirty)
+    {
+      map.fill(~0u);
+    }
+    return dirty;
+  }
+
+  // Nothing is decoded at first
+  map_dirty_t map_dirty = all_maps_dirty();
+
+  // Changes of each tile, and of all tiles. A row of cells is compared
+  // with tile_version only if tile_data_version moved since map_checked.
+  std::array<uint32_t, 384> tile_version;
+  uint32_t tile_data_version;
+  std::array<std::array<uint32_t, 32>, 2> map_checked;
+
+  // Bumped when a cell of the row of a map is decoded again
+  std::array<std::array<uint32_t, 32>, 2> map_row_version;
+
   typedef std::array<byte_t, 4> palette_t;
   // ff47: BGP
   palette_t bgp;
@@ -43,8 +108,26 @@ namespace gameboy
 
   void dma_transfer(byte_t val);
 
+  // Set while a timed DMA copies to OAM, the cpu cannot write OAM then
+  bool dma_active;
+
+  // Update sprite_set for a byte written to OAM
+  void write_oam(dbyte_t addr, byte_t val);
+
+  // Copy all 40 sprites from OAM to sprite_set
+  void decode_sprites();
+
+  // Change the position of a sprite, and the lines it is on
+  void move_sprite(int sprite_num, byte_t y, byte_t x);
+
+  // Put the sprites on the lines again, after their height changed
+  void rebin_sprites();
+
   void write_lcdc(byte_t val);
 
+  // Decode the cells of a row of a map that changed
+  void update_map_row(int map, int map_row);
+
   byte_t write_video_mem(dbyte_t addr, byte_t val)
   {
     if (addr >= 0x8000 && addr < 0xa000)
@@ -56,42 +139,26 @@ namespace gameboy
         // 0b a aaaabbbc, a for tile number, b for row number, c for is_high_byte
         preprocess_tile(addr / 16, (addr % 16) / 2, addr % 2, val);
       }
+      else
+      {
+        // A tile map entry
+        int index = addr & 0x3ff;
+        map_dirty[(addr - 0x9800) >> 10][index / 32] |= 1u << (index % 32);
+      }
     }
     else if (addr >= 0xfe00 && addr < 0xfea0)
     {
-      addr -= 0xfe00;
-      size_t sprite_num = addr / 4;
-      sprite_t &spr = sprite_set[sprite_num];
-      switch (addr % 4)
+      if (dma_active)
       {
-        case 0:
-        spr.y = val;
-        break;
-
-        case 1:
-        spr.x = val;
-        break;
-
-        case 2:
-        spr.tile_num = val;
-        break;
-
-        case 3:
-        spr.hidden = val & 0x80;
-        spr.y_flip = val & 0x40;
-        spr.x_flip = val & 0x20;
-        spr.palette = val & 0x10;
+        // Ignored, keep the old value
+        return mem_at(addr);
       }
-      // printf("sprite %d %d", sprite_num, spr.y);
+      write_oam(addr, val);
     }
     else if (addr >= 0xff40 && addr <= 0xff4b)
     {
       switch (addr)
       {
-        case LY:
-        // Read only
-        return memory.at(0xff44);
-
         case DMA:
         // DMA trnasfer
         dma_transfer(val);
@@ -129,8 +196,18 @@ namespace gameboy
   {
     bg_on = val & (1 << 0);
     sprite_on = val & (1 << 1);
+    bool large_sprite_old = use_large_sprite;
     use_large_sprite = val & (1 << 2);
+    if (use_large_sprite != large_sprite_old)
+    {
+      rebin_sprites();
+    }
+    bool unsigned_tile_num_old = unsigned_tile_num;
     unsigned_tile_num = val & (1 << 4);
+    if (unsigned_tile_num != unsigned_tile_num_old)
+    {
+      map_dirty = all_maps_dirty();
+    }
     win_on = val & (1 << 5);
     bool lcd_on_old = lcd_on;
     lcd_on = val & (1 << 7);
@@ -147,7 +224,7 @@ namespace gameboy
 
     if (!lcd_on)
     {
-      memory.at(LY) = 0;
+      mem_at(LY) = 0;
     }
     else if (!lcd_on_old)
     {
@@ -155,41 +232,265 @@ namespace gameboy
     }
   }
 
+  void write_oam(dbyte_t addr, byte_t val)
+  {
+    addr -= 0xfe00;
+    size_t sprite_num = addr / 4;
+    sprite_t &spr = sprite_set[sprite_num];
+    switch (addr % 4)
+    {
+      case 0:
+      move_sprite(sprite_num, val, spr.x);
+      break;
+
+      case 1:
+      move_sprite(sprite_num, spr.y, val);
+      break;
+
+      case 2:
+      spr.tile_num = val;
+      break;
+
+      case 3:
+      spr.hidden = val & 0x80;
+      spr.y_flip = val & 0x40;
+      spr.x_flip = val & 0x20;
+      spr.palette = val & 0x10;
+    }
+  }
+
+  void decode_sprites()
+  {
+    for (int i = 0; i < 40; i++)
+    {
+      const byte_t *oam = &mem_at(0xfe00 + 4 * i);
+      sprite_t &spr = sprite_set[i];
+      move_sprite(i, oam[0], oam[1]);
+      spr.tile_num = oam[2];
+      spr.hidden = oam[3] & 0x80;
+      spr.y_flip = oam[3] & 0x40;
+      spr.x_flip = oam[3] & 0x20;
+      spr.palette = oam[3] & 0x10;
+    }
+  }
+
+  // Copy bytes first to end of a DMA from src to OAM, then decode the
+  // sprites once
+  void copy_dma_bytes(dbyte_t src, int first, int end)
+  {
+    // The source is within one page
+    const byte_t *from = page_table[src >> 8].read;
+    std::array<byte_t, 0xa0> buf;
+    if (from == nullptr)
+    {
+      for (int i = first; i < end; i++)
+      {
+        buf[i] = read_byte(src + i);
+      }
+      from = buf.data();
+    }
+    copy_by_hardware(0xfe00 + first, from + first, end - first);
+    decode_sprites();
+  }
+
+  int sprite_height()
+  {
+    return use_large_sprite ? 16 : 8;
+  }
+
+  // Add sprite i to the lines it covers or remove it, the lines are dirty
+  void bin_sprite(int i, bool add)
+  {
+    int top = sprite_set[i].y - 16;
+    int end = std::min(top + sprite_height(), screen_row_num);
+    for (int row = std::max(top, 0); row < end; row++)
+    {
+      if (add)
+        line_sprite_mask[row] |= uint64_t(1) << i;
+      else
+        line_sprite_mask[row] &= ~(uint64_t(1) << i);
+      line_sprites[row].dirty = true;
+    }
+  }
+
+  void move_sprite(int sprite_num, byte_t y, byte_t x)
+  {
+    sprite_t &spr = sprite_set[sprite_num];
+    if (spr.y == y && spr.x == x)
+      return;
+    bin_sprite(sprite_num, false);
+    spr.y = y;
+    spr.x = x;
+    bin_sprite(sprite_num, true);
+  }
+
+  void rebin_sprites()
+  {
+    // Lines only covered at the old height are dirty too
+    line_sprite_mask.fill(0);
+    for (line_sprites_t &line : line_sprites)
+    {
+      line.dirty = true;
+    }
+    for (int i = 0; i < 40; i++)
+    {
+      bin_sprite(i, true);
+    }
+  }
+
+  const line_sprites_t &sprites_on_line(int row_num)
+  {
+    line_sprites_t &line = line_sprites[row_num];
+    if (line.dirty)
+    {
+      line.num = 0;
+      for (uint64_t mask = line_sprite_mask[row_num];
+        mask != 0 && line.num < max_line_sprites; mask &= mask - 1)
+      {
+        line.index[line.num++] = __builtin_ctzll(mask);
+      }
+      std::sort(line.index.begin(), line.index.begin() + line.num,
+        [](int lhs, int rhs)
+        {
+          return sprite_set[lhs].x != sprite_set[rhs].x
+            ? sprite_set[lhs].x < sprite_set[rhs].x : lhs < rhs;
+        });
+      line.dirty = false;
+    }
+    return line;
+  }
+
+#ifndef TIMED_DMA
   void dma_transfer(byte_t val)
   {
-    // dbyte_t addr = 0x100 * val;
-    // byte_t *dst = &memory.at(0xfe00);
-    // byte_t *src = &memory.at(addr);
-    // memcpy(dst, src, 0xa0 * sizeof(byte_t));
-    dbyte_t src = 0x100 * val;
-    dbyte_t dst = 0xfe00;
-    for (int i = 0; i < 0xa0; i++)
+    copy_dma_bytes(val << 8, 0, 0xa0);
+  }
+
+  void run_dma() { }
+#else
+  // Copying one byte takes 4 clocks, OAM reads ff until done
+  const int dma_byte_clocks = 4;
+  dbyte_t dma_src;
+  long long dma_begin;
+  int dma_copied;
+  std::array<byte_t, 0x100> dma_oam_bus;
+
+  void copy_dma(int end)
+  {
+    if (end > dma_copied)
+    {
+      copy_dma_bytes(dma_src, dma_copied, end);
+      dma_copied = end;
+    }
+    if (dma_copied == 0xa0)
+    {
+      dma_active = false;
+      page_table[0xfe].read = &mem_at(0xfe00);
+    }
+  }
+
+  void run_dma()
+  {
+    if (dma_active)
     {
-      // printf("dst=%hx\n", dst+i);
-      mem_ref(dst + i) = memory.at(src + i);
+      long long due = (cpu_clock - dma_begin) / dma_byte_clocks;
+      copy_dma(due < 0xa0 ? int(due) : 0xa0);
     }
-    // printf("%hhd %hhd %x\n", memory.at(0xfe01), memory.at(0xfe00), memory.at(0xfe02));
-    // printf("%hhd %hhd %x\n", sprite_set[0].x, sprite_set[0].y, sprite_set[0].tile_num);
   }
 
+  void dma_transfer(byte_t val)
+  {
+    if (dma_active)
+    {
+      // Restarted, finish the old one at once
+      copy_dma(0xa0);
+    }
+    dma_active = true;
+    dma_src = val << 8;
+    dma_begin = cpu_clock;
+    dma_copied = 0;
+    dma_oam_bus.fill(0xff);
+    page_table[0xfe].read = dma_oam_bus.data();
+  }
+#endif
+  // The 8 pixels of a tile row as one word, pixel 0 in the first byte
+  inline uint64_t load_row(const color_t *row)
+  {
+    uint64_t pixels;
+    memcpy(&pixels, row, 8);
+    return pixels;
+  }
+
+  const uint64_t low_bits = 0x0101010101010101;
+
+  // Byte i is bit 7 - i of the index, so a byte of tile data decodes to a
+  // bit plane of a row with one lookup
+  std::array<uint64_t, 0x100> make_bit_spread()
+  {
+    std::array<uint64_t, 0x100> table;
+    for (int val = 0; val < 0x100; val++)
+    {
+      std::array<color_t, 8> row;
+      for (int i = 0; i < 8; i++)
+      {
+        row[i] = val >> (7 - i) & 1;
+      }
+      table[val] = load_row(row.data());
+    }
+    return table;
+  }
+
+  const std::array<uint64_t, 0x100> bit_spread = make_bit_spread();
+
   void preprocess_tile(dbyte_t tile_num, byte_t row_num, bool is_high_byte,
     byte_t val)
   {
     tile_t &tile = tile_set[tile_num];
     std::array<byte_t, 8> &row = tile[row_num];
 
-    // Write to write_bit, while remain the other bit as is
-    byte_t write_bit = is_high_byte ? 2 : 1;
-    byte_t mask = 0x80;
-    for (int i = 0; i < 8; i++, mask >>= 1)
+    // Replace one bit plane, keep the other
+    int shift = is_high_byte ? 1 : 0;
+    uint64_t pixels = load_row(row.data()) & ~(low_bits << shift);
+    pixels |= bit_spread[val] << shift;
+    memcpy(row.data(), &pixels, 8);
+    tile_version[tile_num]++;
+    tile_data_version++;
+  }
+
+  dbyte_t bg_tile_num(byte_t code);
+
+  void update_map_row(int map, int map_row)
+  {
+    std::array<map_cell_t, 32 * 32> &cells = map_cells[map];
+    uint32_t dirty = map_dirty[map][map_row];
+    if (map_checked[map][map_row] != tile_data_version)
     {
-      if (mask & val)
+      for (int i = 0; i < 32; i++)
       {
-        row[i] |= write_bit;
+        const map_cell_t &cell = cells[map_row * 32 + i];
+        if (cell.version != tile_version[cell.tile_num])
+          dirty |= 1u << i;
       }
-      else
+      map_checked[map][map_row] = tile_data_version;
+    }
+    map_dirty[map][map_row] = 0;
+    if (dirty != 0)
+    {
+      map_row_version[map][map_row]++;
+    }
+
+    dbyte_t map_addr = 0x9800 + 0x400 * map + 32 * map_row;
+    for (; dirty != 0; dirty &= dirty - 1)
+    {
+      int col = __builtin_ctz(dirty);
+      dbyte_t tile_num = bg_tile_num(mem_at(map_addr + col));
+      cells[map_row * 32 + col] = {tile_num, tile_version[tile_num]};
+      cell_palette[map][map_row * 32 + col] = 0;
+      row_palette[map][map_row] = 0;
+      const tile_t &tile = tile_set[tile_num];
+      for (int i = 0; i < 8; i++)
       {
-        row[i] &= ~write_bit;
+        memcpy(&map_planes[map][map_row * 8 + i][col * 8], tile[i].data(), 8);
       }
     }
   }
@@ -203,53 +504,243 @@ namespace gameboy
     }
   }
 
-  // Copy 8 bytes
-  void copy_one_row(const tile_t &tile, uint8_t row_num,
-    const palette_t &plt, color_t *dst, int len = 8);
+  // The colors of 8 pixels through the palette. With SSSE3 the palette is
+  // a byte shuffle, otherwise the same is done on the bytes of a word, with
+  // the same result.
+  inline uint64_t apply_palette(uint64_t pixels, const palette_t &plt)
+  {
+#ifdef __SSSE3__
+    uint32_t plt_word;
+    memcpy(&plt_word, plt.data(), 4);
+    __m128i colors = _mm_shuffle_epi8(_mm_cvtsi32_si128(plt_word),
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&pixels)));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(&pixels), colors);
+    return pixels;
+#else
+    uint64_t bit0 = pixels & low_bits, bit1 = pixels >> 1 & low_bits;
+    // One in the bytes of each color
+    return (~(bit0 | bit1) & low_bits) * plt[0] + (bit0 & ~bit1) * plt[1]
+      + (bit1 & ~bit0) * plt[2] + (bit0 & bit1) * plt[3];
+#endif
+  }
+
+  // Draw 8 pixels through the palette, color 0 is transparent
+  inline void draw_row(uint64_t pixels, const palette_t &plt, color_t *dst)
+  {
+#ifdef __SSSE3__
+    __m128i idx = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&pixels));
+    uint32_t plt_word;
+    memcpy(&plt_word, plt.data(), 4);
+    __m128i colors = _mm_shuffle_epi8(_mm_cvtsi32_si128(plt_word), idx);
+    __m128i clear = _mm_cmpeq_epi8(idx, _mm_setzero_si128());
+    __m128i *dst_vec = reinterpret_cast<__m128i *>(dst);
+    __m128i old = _mm_loadl_epi64(dst_vec);
+    _mm_storel_epi64(dst_vec, _mm_or_si128(_mm_and_si128(clear, old),
+      _mm_andnot_si128(clear, colors)));
+#else
+    uint64_t opaque = ((pixels | pixels >> 1) & low_bits) * 0xff;
+    uint64_t old;
+    memcpy(&old, dst, 8);
+    old = (old & ~opaque) | (apply_palette(pixels, plt) & opaque);
+    memcpy(dst, &old, 8);
+#endif
+  }
+
+  byte_t palette_byte(const palette_t &plt)
+  {
+    return plt[0] | plt[1] << 2 | plt[2] << 4 | plt[3] << 6;
+  }
 
-  const tile_t &get_bg_tile(byte_t code);
+  // Tiles resolved through a palette, keyed by tile and palette byte, so
+  // palettes switched back and forth are not resolved again. Direct
+  // mapped, an entry is stale once its tile changed (see tile_version).
+  struct resolved_tile_t
+  {
+    // Plus one, 0 if empty
+    int tile_key;
+    byte_t palette;
+    uint32_t version;
+    tile_t colors;
+  };
+  const int resolved_tile_num = 1024;
+  std::array<resolved_tile_t, resolved_tile_num> resolved_tiles;
+  unsigned long long resolved_tile_hits, resolved_tile_misses;
+
+  const tile_t &resolve_tile(int tile_num, const palette_t &plt)
+  {
+    byte_t palette = palette_byte(plt);
+    resolved_tile_t &entry =
+      resolved_tiles[(tile_num ^ palette << 2) % resolved_tile_num];
+    if (entry.tile_key == tile_num + 1 && entry.palette == palette
+      && entry.version == tile_version[tile_num])
+    {
+      resolved_tile_hits++;
+      return entry.colors;
+    }
+    resolved_tile_misses++;
+    entry.tile_key = tile_num + 1;
+    entry.palette = palette;
+    entry.version = tile_version[tile_num];
+    const tile_t &tile = tile_set[tile_num];
+    for (int i = 0; i < 8; i++)
+    {
+      uint64_t colors = apply_palette(load_row(tile[i].data()), plt);
+      memcpy(entry.colors[i].data(), &colors, 8);
+    }
+    return entry.colors;
+  }
+
+  void resolve_map_row(int map, int map_row)
+  {
+    dbyte_t palette_key = palette_byte(bgp) + 1;
+    if (row_palette[map][map_row] == palette_key)
+      return;
+    for (int col = 0; col < 32; col++)
+    {
+      int cell = map_row * 32 + col;
+      if (cell_palette[map][cell] == palette_key)
+        continue;
+      const tile_t &colors = resolve_tile(map_cells[map][cell].tile_num, bgp);
+      for (int i = 0; i < 8; i++)
+      {
+        memcpy(&color_planes[map][map_row * 8 + i][col * 8], colors[i].data(),
+          8);
+      }
+      cell_palette[map][cell] = palette_key;
+    }
+    row_palette[map][map_row] = palette_key;
+  }
+
+  // Copy len colors. Rows are short, inline copies are faster than memcpy.
+  inline void copy_pixels(const color_t *src, int len, color_t *dst)
+  {
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+      memcpy(dst + i, src + i, 8);
+    }
+    for (; i < len; i++)
+    {
+      dst[i] = src[i];
+    }
+  }
+
+  // Draw len color indices through the palette, color 0 is transparent
+  void draw_pixels(const color_t *src, int len, const palette_t &plt,
+    color_t *dst);
 
   void render_sprite(const sprite_t &, byte_t row_num, color_t *dst);
 
+  // Draw len pixels of a line of a map from column col, wrapping around.
+  // Opaque lines are copied from color_planes, otherwise color 0 is
+  // transparent.
+  void draw_map_line(int map, byte_t plane_row, byte_t col, int len,
+    bool opaque, color_t *dst)
+  {
+    update_map_row(map, plane_row / 8);
+    int first_len = std::min(len, 256 - col);
+    if (opaque)
+    {
+      resolve_map_row(map, plane_row / 8);
+      const color_t *src = color_planes[map][plane_row].data();
+      copy_pixels(src + col, first_len, dst);
+      copy_pixels(src, len - first_len, dst + first_len);
+    }
+    else
+    {
+      const color_t *src = map_planes[map][plane_row].data();
+      draw_pixels(src + col, first_len, bgp, dst);
+      draw_pixels(src, len - first_len, bgp, dst + first_len);
+    }
+  }
+
+  // What a line drawn with only the background showed. It is drawn again
+  // only if this changes.
+  struct line_key_t
+  {
+    bool bg_on;
+    byte_t scx, scy, palette;
+    int map;
+    uint32_t map_version;
+
+    bool operator ==(const line_key_t &other) const
+    {
+      return bg_on == other.bg_on && scx == other.scx && scy == other.scy
+        && palette == other.palette && map == other.map
+        && map_version == other.map_version;
+    }
+  };
+  std::array<line_key_t, screen_row_num> line_keys;
+  // False if the line was last drawn by the full path
+  std::array<bool, screen_row_num> line_key_valid;
+
+  // How lines were drawn: kept from the frame before, background only, or
+  // with sprites or window
+  unsigned long long lines_reused, lines_background, lines_full;
+
+  // Draw a line without sprites or window, unless it already shows it
+  void render_background_row(int row_num,
+    std::array<color_t, screen_column_num + 16> &buf)
+  {
+    byte_t up = mem_at(SCY);
+    byte_t relative_row = up + row_num;
+    int map = bg_map_addr == 0x9800 ? 0 : 1;
+    line_key_t key = {bg_on, mem_at(SCX), up, palette_byte(bgp), map, 0};
+    if (bg_on)
+    {
+      update_map_row(map, relative_row / 8);
+      key.map_version = map_row_version[map][relative_row / 8];
+    }
+    if (line_key_valid[row_num] && line_keys[row_num] == key)
+    {
+      lines_reused++;
+      return;
+    }
+    line_keys[row_num] = key;
+    line_key_valid[row_num] = true;
+    lines_background++;
+    if (bg_on)
+    {
+      draw_map_line(map, relative_row, key.scx, screen_column_num, true,
+        buf.begin() + 8);
+    }
+    else
+    {
+      memset(buf.begin() + 8, bgp[0], screen_column_num);
+    }
+  }
+
   void render_row(int row_num)
   {
     std::array<color_t, screen_column_num + 16> &buf = screen_buf.at(row_num);
 
-    // First prepare the sprites
-    std::vector<byte_t> spr_top, spr_bottom;
-    for (int i = 0; i < 40; i++)
+    // Drawn from the lowest priority
+    const line_sprites_t &line = sprites_on_line(row_num);
+
+    if ((!sprite_on || line.num == 0) && !(win_on && mem_at(WY) <= row_num))
     {
-      const sprite_t &spr = sprite_set[i];
-      int diff = row_num - (spr.y - 16);
-      if (diff >= 0 && diff < 8)
-      {
-        if (spr.hidden)
-        {
-          spr_bottom.push_back(i);
-        }
-        else
-        {
-          spr_top.push_back(i);
-        }
-      }
+      render_background_row(row_num, buf);
+      return;
     }
-    // Sort so the priority decreases
-    auto cmp = [](int lhs, int rhs)
-    { return sprite_set[lhs].x < sprite_set[rhs].x; };
-    std::stable_sort(spr_bottom.begin(), spr_bottom.end(), cmp);
-    std::stable_sort(spr_top.begin(), spr_top.end(), cmp);
+    line_key_valid[row_num] = false;
+    lines_full++;
 
     // Later, color 0 of bgp is transparent
     memset(buf.begin() + 8, bgp[0], screen_column_num);
 
-    // Sprites in the bottom
+    // Sprites in the bottom. Without them, color 0 of the background and
+    // the window is the color already there.
+    bool opaque = true;
     if (sprite_on)
     {
-      for (auto i = spr_bottom.crbegin(); i != spr_bottom.crend(); i++)
+      for (int i = line.num - 1; i >= 0; i--)
       {
-        const sprite_t &spr = sprite_set[*i];
-        color_t *dst = buf.begin() + 8 + (spr.x - 8);
-        render_sprite(spr, row_num, dst);
+        const sprite_t &spr = sprite_set[line.index[i]];
+        if (spr.hidden)
+        {
+          render_sprite(spr, row_num, buf.begin() + spr.x);
+          opaque = false;
+        }
       }
     }
 
@@ -257,70 +748,54 @@ namespace gameboy
     if (bg_on)
     {
       // Position of screen relative to background
-      byte_t left = memory.at(SCX);
-      byte_t up = memory.at(SCY);
-      dbyte_t relative_row = (up + row_num) % 256;
-      dbyte_t map_base = bg_map_addr + 32 * (relative_row / 8);
-      int map_index_begin = left / 8;
-      auto copy_dst = buf.begin() + 8 - left % 8;
+      byte_t left = mem_at(SCX);
+      byte_t up = mem_at(SCY);
+      byte_t relative_row = up + row_num;
+      int map = bg_map_addr == 0x9800 ? 0 : 1;
       byte_t right;
-      if (win_on && memory.at(WY) <= row_num)
+      if (win_on && mem_at(WY) <= row_num)
       {
         // Need to draw window
-        right = memory.at(WX) - 7;
+        right = mem_at(WX) - 7;
       }
       else
       {
         right = screen_column_num;
       }
-      // Copy starts at -left % 8, compensate for this
+      // Wraps around like the tile loop that drew from -left % 8 did
       right += left % 8;
-      int tile_num = right / 8;
+      int len = std::min(std::max(right - left % 8, 0), screen_column_num);
       if (debugger_on)
-      printf("%hhd %hhd %hd %hx %d %d\n", left, up, relative_row, map_base, map_index_begin, copy_dst - buf.begin());
+      printf("%hhd %hhd %hhd %d %d\n", left, up, relative_row, map, len);
 
-      for (int i = 0; i < tile_num; i++)
-      {
-        // if (debugger_on)
-        // printf("Tile %.2hhx-%.2hhx row %hhd\n",map_base + (i + map_index_begin) % 32, memory.at(map_base + (i + map_index_begin) % 32), relative_row % 8);
-        copy_one_row(
-          get_bg_tile(memory.at(map_base + (i + map_index_begin) % 32)),
-          relative_row % 8, bgp, copy_dst + 8 * i);
-      }
-      // Draw the final tile
-      copy_one_row(
-        get_bg_tile(memory.at(map_base + (tile_num + map_index_begin) % 32)),
-        relative_row % 8, bgp, copy_dst + 8 * tile_num, right % 8);
+      draw_map_line(map, relative_row, left, len, opaque, buf.begin() + 8);
     }
 
     // Window
     if (bg_on && win_on)
     {
       // Absolute position (relative to the screen)
-      byte_t up = memory.at(WY);
-      if (up <= row_num)
+      byte_t up = mem_at(WY);
+      byte_t left = mem_at(WX) - 7;
+      if (up <= row_num && left < screen_column_num)
       {
-        dbyte_t relative_row = row_num - up;
-        byte_t left = memory.at(WX) - 7;
-        dbyte_t map_base = win_map_addr + 32 * (relative_row / 8);
-        int tile_num = (160 - left) / 8 + 1;
-        auto copy_dst = buf.begin() + 8 + left;
-        for (int i = 0; i < tile_num; i++)
-        {
-          copy_one_row(get_bg_tile(memory.at(map_base + i)),
-            relative_row % 8, bgp, copy_dst + 8 * i);
-        }
+        int relative_row = row_num - up;
+        int map = win_map_addr == 0x9800 ? 0 : 1;
+        draw_map_line(map, relative_row, 0, screen_column_num - left, opaque,
+          buf.begin() + 8 + left);
       }
     }
 
     // Sprites on top
     if (sprite_on)
     {
-      for (auto i = spr_top.crbegin(); i != spr_top.crend(); i++)
+      for (int i = line.num - 1; i >= 0; i--)
       {
-        const sprite_t &spr = sprite_set[*i];
-        color_t *dst = buf.begin() + 8 + (spr.x - 8);
-        render_sprite(spr, row_num, dst);
+        const sprite_t &spr = sprite_set[line.index[i]];
+        if (!spr.hidden)
+        {
+          render_sprite(spr, row_num, buf.begin() + spr.x);
+        }
       }
     }
   }
@@ -329,59 +804,64 @@ namespace gameboy
   {
     // copy_one_row(tile_set[spr.tile_num], row_num - (spr.y - 16),
     //   obp[spr.palette], buf.begin() + 8 + (spr.x - 8));
-    const tile_t &tile = tile_set[spr.tile_num];
-
-    byte_t tile_row = row_num - (spr.y - 16);
+    // Off the screen, in the margin or beyond
+    if (spr.x == 0 || spr.x >= screen_column_num + 8)
+      return;
+
+    int height = sprite_height();
+    int tile_row = row_num - (spr.y - 16);
+    if (tile_row < 0 || tile_row >= height)
+      return;
     if (spr.y_flip)
     {
-      tile_row = 7 - tile_row;
+      tile_row = height - 1 - tile_row;
     }
-    const std::array<color_t, 8> &row = tile[tile_row];
-
-    const palette_t &plt = obp[spr.palette];
-    if (!spr.x_flip)
+    // 8x16 sprites are an even tile and the next one
+    int tile_num = height == 16 ? spr.tile_num & 0xfe : spr.tile_num;
+    const tile_t &tile = tile_set[tile_num + tile_row / 8];
+    uint64_t pixels = load_row(tile[tile_row % 8].data());
+    if (spr.x_flip)
     {
-      for (int i = 0; i < 8; i++)
-      {
-        color_t c = row[i];
-        if (c)
-          dst[i] = plt[c];
-      }
-    }
-    else
-    {
-      for (int i = 0; i < 8; i++)
-      {
-        color_t c = row[7 - i];
-        if (c)
-          dst[i] = plt[c];
-      }
+      // Reversing the bytes reverses the pixels
+      pixels = __builtin_bswap64(pixels);
     }
+    draw_row(pixels, obp[spr.palette], dst);
   }
 
-  const tile_t &get_bg_tile(byte_t code)
+  dbyte_t bg_tile_num(byte_t code)
   {
     if (unsigned_tile_num)
     {
-      // if (debugger_on)
-      // printf("%.2hhx ", code);
-      return tile_set[code];
+      return code;
     }
     else
     {
-      // if (debugger_on)
-      // printf("s%d ", 256 + code);
-      return tile_set[add_signed(dbyte_t(256), code)];
+      return add_signed(dbyte_t(256), code);
     }
   }
 
-  void copy_one_row(const tile_t &tile, uint8_t row_num,
-    const palette_t &plt, color_t *dst, int len)
+  void print_video_stats()
+  {
+    unsigned long long total = resolved_tile_hits + resolved_tile_misses;
+    printf("Resolved tile cache: %llu hits, %llu misses (%.1f%% hits)\n",
+      resolved_tile_hits, resolved_tile_misses,
+      total != 0 ? 100.0 * resolved_tile_hits / total : 0.0);
+    printf("Lines: %llu kept from the last frame, %llu background only, "
+      "%llu with sprites or window\n", lines_reused, lines_background,
+      lines_full);
+  }
+
+  void draw_pixels(const color_t *src, int len, const palette_t &plt,
+    color_t *dst)
   {
-    const std::array<color_t, 8> &row = tile[row_num];
-    for (int i = 0; i < len; i++)
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+      draw_row(load_row(src + i), plt, dst + i);
+    }
+    for (; i < len; i++)
     {
-      color_t c = row[i];
+      color_t c = src[i];
       if (c)
         dst[i] = plt[c];
     }
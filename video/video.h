@@ -22,14 +22,23 @@ namespace gameboy
   // Does not affect external state, such as LY or STAT.
   void render_row(int row_num);
 
+  // With TIMED_DMA, a DMA to OAM copies a byte every 4 clocks, and OAM
+  // reads ff until it is done. Copy what is due by cpu_clock. Without
+  // TIMED_DMA the copy happens at once and this does nothing.
+  void run_dma();
+
   // Handle writing to video memory, return the new value of the registers.
   // Video memory includes:
   // 8000-a000: Video ram;
   // fe00-fea0: Sprite memory;
-  // ff40 (LCDC) ff41 (STAT) ff42 (SCY) ff43 (SCX) ff44 (LY)  ff45 (LYC)
+  // ff40 (LCDC) ff41 (STAT) ff42 (SCY) ff43 (SCX) ff45 (LYC)
   // ff46 (DMA) ff47 (BGP) ff48 (OBP0) ff49 (OBP1) ff4a (WY) ff4b (WX).
+  // ff44 (LY) is read only, see io_table.
   byte_t write_video_mem(dbyte_t addr, byte_t val);
 
+  // Print how well the caches of the renderer work
+  void print_video_stats();
+
   enum {LCDC = 0xff40, STAT, SCY, SCX, LY, LYC, DMA, BGP, OBP0, OBP1, WY, WX};
 
   extern bool lcd_on;